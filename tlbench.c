@@ -0,0 +1,663 @@
+/*
+ * tlbench.c
+ * ver. 2.3
+ *
+ */
+
+/*
+ * TL100/TL200 conditioning benchmark - 2.3
+ *
+ * Copyright (C) 2014-2016 TectroLabs, http://tectrolabs.com
+ *
+ * This is a user space program that runs the conditioning and health test
+ * code of the 'tlrandom' kernel module (tlcond.h) without a kernel module or
+ * a TL device. It first checks the code against the FIPS 180 SHA-256 test
+ * vectors and a few fixed health test and de-framing cases, stresses the
+ * lock-free claim protocol of the output buffer with several reader threads
+ * and a refilling thread, then reports
+ * MB/s and CPU cycles per byte for each processing stage at different
+ * buffer sizes.
+ *
+ * Build and run it with:
+ * cc -O2 -pthread -o tlbench tlbench.c
+ * ./tlbench
+ *
+ * Options:
+ *   -w <words>   number of raw 32 bit words hashed into one output block (default 16)
+ *   -m           condition with HMAC-SHA256 instead of SHA-256
+ *   -p <bytes>   bulk-in packet size used for de-framing (default 512)
+ *   -t <msecs>   minimum run time for each measurement (default 200)
+ *   -c           print results as comma separated values
+ *
+ * The program exits with a non-zero status when any of the checks fail, so
+ * it can be used in a build pipeline before deploying a new module build.
+ * Compare the CSV output between builds to catch performance regressions.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "tlcond.h"
+
+#define SUCCESS (0)
+
+// Number of consecutive health test failures used by the benchmark
+#define BENCH_FAIL_THRESHOLD (4)
+
+// Device ID stamped into the conditioning nonce by the benchmark
+#define BENCH_DEVICE_ID (0x544c3230)
+
+// Output buffer slots, reader threads and serial numbers handed out by the reservoir check
+#define RESERVOIR_SLOTS (4096)
+#define RESERVOIR_CLAIMERS (4)
+#define RESERVOIR_SERIALS (1 << 20)
+
+// Input buffer sizes to benchmark, in bytes
+static const int benchSizes[] = { 1024, 4096, 16384, 65536, 262144, 1048576 };
+
+#define NUM_BENCH_SIZES (sizeof(benchSizes) / sizeof(benchSizes[0]))
+
+enum bench_stage {
+	STAGE_DEFRAME,
+	STAGE_CONDITION,
+	STAGE_RCT,
+	STAGE_APT,
+	STAGE_PIPELINE,
+	STAGE_STREAM,
+	NUM_STAGES
+};
+
+static const char *stageNames[NUM_STAGES] = { "deframe", "condition", "rct", "apt", "pipeline", "stream" };
+
+static int blockWords = 16;
+static int packetSize = 512;
+static int minRunMsecs = 200;
+static int csvOutput = 0;
+
+static struct tl_sha256_data shaData;
+static struct tl_hmac_sha256 hmacData;
+static struct tl_hmac_sha256 *condHmac;
+static struct tl_rct_data rctData;
+static struct tl_apt_data aptData;
+static struct tl_cond_stream condStream;
+
+// The reservoir check models the output buffer with slots holding serial numbers, a byte handed out
+// twice or moved while it is copied shows up as a serial number seen twice
+static _Atomic int64_t reservoirWord;
+static atomic_int copiesInFlight;
+static atomic_int isReservoirDone;
+static uint32_t reservoirSlots[RESERVOIR_SLOTS];
+static int curSlotIdx;
+static int slotsLen;
+static atomic_uchar *serialsSeen;
+static atomic_long reservoirDuplicates;
+
+static uint8_t *framedBuff;
+static int framedLength;
+static uint8_t *rawBuff;
+static uint8_t *condBuff;
+
+/**
+ * Get the current time in nanoseconds
+ *
+ * @return uint64_t - monotonic time in nanoseconds
+ *
+ */
+static uint64_t now_nsecs(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Get the CPU time stamp counter
+ *
+ * @return uint64_t - the time stamp counter or 0 when not available
+ *
+ */
+static uint64_t now_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Fill a buffer with pseudo random bytes
+ *
+ * @param uint8_t *buff - pointer to the buffer
+ * @param int length - buffer size in bytes
+ * @param uint32_t seed - initial state of the generator
+ *
+ */
+static void fill_pseudo_random(uint8_t *buff, int length, uint32_t seed) {
+	int i;
+
+	for (i = 0; i < length; i++) {
+		// xorshift32
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		buff[i] = (uint8_t)seed;
+	}
+}
+
+/**
+ * Frame raw bytes the way the FTDI chip sends them, with status bytes in front of every packet
+ *
+ * @param const uint8_t *src - pointer to the raw bytes
+ * @param int length - number of raw bytes
+ * @param uint8_t *dst - pointer to the framed buffer
+ * @return int - number of framed bytes
+ *
+ */
+static int ftdi_frame(const uint8_t *src, int length, uint8_t *dst) {
+	int cnt = 0;
+	int i = 0;
+
+	while (i < length) {
+		if ((cnt % packetSize) == 0) {
+			dst[cnt++] = 0x31;
+			dst[cnt++] = 0x60;
+		} else {
+			dst[cnt++] = src[i++];
+		}
+	}
+	return cnt;
+}
+
+/**
+ * Close the reservoir the way the module does before it refills: make the generation odd and
+ * wait for the claimed ranges to be copied
+ *
+ */
+static void reservoir_close(void) {
+	int64_t word = atomic_load(&reservoirWord);
+
+	do {
+		if (tl_reservoir_gen(word) & 1) {
+			return;
+		}
+	} while (!atomic_compare_exchange_weak(&reservoirWord, &word, tl_reservoir_word(tl_reservoir_gen(word) + 1, tl_reservoir_idx(word), tl_reservoir_end(word))));
+	curSlotIdx = tl_reservoir_idx(word);
+	while (atomic_load(&copiesInFlight) != 0) {
+		sched_yield();
+	}
+}
+
+/**
+ * Publish the slot indexes to the claimers with the next even generation
+ *
+ */
+static void reservoir_open(void) {
+	int64_t word = atomic_load(&reservoirWord);
+
+	if (tl_reservoir_gen(word) & 1) {
+		atomic_store_explicit(&reservoirWord, tl_reservoir_word(tl_reservoir_gen(word) + 1, curSlotIdx, slotsLen), memory_order_release);
+	}
+}
+
+/**
+ * Claim and copy slots without a lock the way the module reads bytes, then count every serial number seen
+ *
+ * @param void *arg - seed of the claim sizes
+ * @return void * - NULL
+ *
+ */
+static void *reservoir_claimer(void *arg) {
+	uint32_t copy[64];
+	uint32_t seed = (uint32_t)(uintptr_t)arg;
+	int64_t word;
+	int64_t claimed;
+	int length;
+	int act = 0;
+	int avail;
+	int i;
+
+	while (!atomic_load(&isReservoirDone)) {
+		seed = seed * 1103515245 + 12345;
+		length = 1 + (seed >> 16) % 64;
+		if (tl_reservoir_gen(atomic_load(&reservoirWord)) & 1) {
+			sched_yield();
+			continue;
+		}
+		atomic_fetch_add(&copiesInFlight, 1);
+		word = atomic_load(&reservoirWord);
+		if (seed & 0x100) {
+			// Give the refiller a chance to close the reservoir before the claim
+			sched_yield();
+		}
+		do {
+			avail = tl_reservoir_end(word) - tl_reservoir_idx(word);
+			if ((tl_reservoir_gen(word) & 1) || avail <= 0) {
+				avail = 0;
+				break;
+			}
+			act = length < avail ? length : avail;
+			claimed = tl_reservoir_word(tl_reservoir_gen(word), tl_reservoir_idx(word) + act, tl_reservoir_end(word));
+		} while (!atomic_compare_exchange_weak(&reservoirWord, &word, claimed));
+		if (avail > 0 && (seed & 0x200)) {
+			// and to wait for the copy of a claimed range
+			sched_yield();
+		}
+		if (avail > 0) {
+			memcpy(copy, reservoirSlots + tl_reservoir_idx(word), act * sizeof(copy[0]));
+		}
+		atomic_fetch_sub(&copiesInFlight, 1);
+		for (i = 0; avail > 0 && i < act; i++) {
+			if (copy[i] == 0 || copy[i] >= RESERVOIR_SERIALS || atomic_fetch_add(&serialsSeen[copy[i]], 1) != 0) {
+				atomic_fetch_add(&reservoirDuplicates, 1);
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Refill the reservoir the way the module does: close it, move the unclaimed slots to the front,
+ * wipe the rest and fill it with new serial numbers, then open it again
+ *
+ * @param void *arg - not used
+ * @return void * - NULL
+ *
+ */
+static void *reservoir_refiller(void *arg) {
+	uint32_t serial = 1;
+	int unread;
+
+	(void)arg;
+	for (;;) {
+		reservoir_close();
+		unread = slotsLen - curSlotIdx;
+		if (unread == 0 && serial == RESERVOIR_SERIALS) {
+			atomic_store(&isReservoirDone, 1);
+			break;
+		}
+		memmove(reservoirSlots, reservoirSlots + curSlotIdx, unread * sizeof(reservoirSlots[0]));
+		memset(reservoirSlots + unread, 0x00, (RESERVOIR_SLOTS - unread) * sizeof(reservoirSlots[0]));
+		curSlotIdx = 0;
+		slotsLen = unread;
+		while (slotsLen < RESERVOIR_SLOTS && serial < RESERVOIR_SERIALS) {
+			reservoirSlots[slotsLen++] = serial++;
+		}
+		reservoir_open();
+		sched_yield();
+	}
+	return NULL;
+}
+
+/**
+ * Check that the lock-free claims and the refills hand every serial number out exactly once
+ *
+ * @return int - 0 when the check passes
+ *
+ */
+static int check_reservoir(void) {
+	pthread_t claimers[RESERVOIR_CLAIMERS];
+	pthread_t refiller;
+	long missing = 0;
+	int failures = 0;
+	int i;
+
+	serialsSeen = calloc(RESERVOIR_SERIALS, sizeof(*serialsSeen));
+	if (serialsSeen == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	// Start closed with no slots, the refiller opens it
+	atomic_store(&reservoirWord, tl_reservoir_word(1, 0, 0));
+	for (i = 0; i < RESERVOIR_CLAIMERS; i++) {
+		pthread_create(&claimers[i], NULL, reservoir_claimer, (void *)(uintptr_t)(i + 1));
+	}
+	pthread_create(&refiller, NULL, reservoir_refiller, NULL);
+	pthread_join(refiller, NULL);
+	for (i = 0; i < RESERVOIR_CLAIMERS; i++) {
+		pthread_join(claimers[i], NULL);
+	}
+
+	for (i = 1; i < RESERVOIR_SERIALS; i++) {
+		if (atomic_load(&serialsSeen[i]) == 0) {
+			missing++;
+		}
+	}
+	if (atomic_load(&reservoirDuplicates) != 0 || missing != 0) {
+		fprintf(stderr, "FAILED: lock-free claims overlap, %ld slot(s) handed out twice or stale, %ld never handed out\n",
+				atomic_load(&reservoirDuplicates), missing);
+		failures++;
+	}
+	free(serialsSeen);
+	return failures;
+}
+
+/**
+ * Run the known answer and sanity checks
+ *
+ * @return int - 0 when all checks pass
+ *
+ */
+static int run_checks(void) {
+	uint8_t raw[4096];
+	uint8_t framed[4096 * 2];
+	uint8_t deframed[4096];
+	uint32_t out1[TL_SHA256_OUT_WORDS * 4];
+	uint32_t out2[TL_SHA256_OUT_WORDS * 4];
+	struct tl_cond_stream cs;
+	int framedCnt;
+	int split;
+	int cnt;
+	int failures = 0;
+
+	if (tl_sha256_knownAnswerTest(&shaData) != SUCCESS) {
+		fprintf(stderr, "FAILED: SHA-256 known answer test\n");
+		failures++;
+	}
+	if (tl_hmac_sha256_knownAnswerTest(&shaData, &hmacData) != SUCCESS) {
+		fprintf(stderr, "FAILED: HMAC-SHA256 known answer test\n");
+		failures++;
+	}
+	tl_hmac_sha256_initialize(&shaData, &hmacData, tl_cond_hmacKey, 8);
+
+	// Conditioning is deterministic for the same input and nonce
+	fill_pseudo_random(raw, sizeof(raw), 1);
+	tl_cond_initializeNonce(&shaData, BENCH_DEVICE_ID, 1);
+	tl_sha256_initializeSerialNumber(&shaData, 0);
+	tl_cond_conditionWords(&shaData, condHmac, (uint32_t *)raw, blockWords * 4, blockWords, out2);
+	tl_cond_initializeNonce(&shaData, BENCH_DEVICE_ID, 0);
+	tl_sha256_initializeSerialNumber(&shaData, 0);
+	tl_cond_conditionWords(&shaData, condHmac, (uint32_t *)raw, blockWords * 4, blockWords, out1);
+	if (memcmp(out1, out2, sizeof(out1)) == 0) {
+		fprintf(stderr, "FAILED: slices with the same counter give the same output\n");
+		failures++;
+	}
+	tl_cond_initializeNonce(&shaData, BENCH_DEVICE_ID, 0);
+	tl_sha256_initializeSerialNumber(&shaData, 0);
+	tl_cond_conditionWords(&shaData, condHmac, (uint32_t *)raw, blockWords * 4, blockWords, out2);
+	if (memcmp(out1, out2, sizeof(out1)) != 0) {
+		fprintf(stderr, "FAILED: conditioning is not deterministic\n");
+		failures++;
+	}
+	if (memcmp(out1, out1 + TL_SHA256_OUT_WORDS, TL_SHA256_OUT_WORDS * 4) == 0) {
+		fprintf(stderr, "FAILED: serial number stamp does not change the output\n");
+		failures++;
+	}
+
+	// De-framing restores the original data, with a transfer split in two parts
+	framedCnt = ftdi_frame(raw, sizeof(raw), framed);
+	cnt = tl_ftdi_deframe(framed, packetSize * 3, packetSize, deframed, 0, sizeof(raw));
+	cnt = tl_ftdi_deframe(framed + packetSize * 3, framedCnt - packetSize * 3, packetSize, deframed, cnt, sizeof(raw));
+	if (cnt != sizeof(raw) || memcmp(raw, deframed, sizeof(raw)) != 0) {
+		fprintf(stderr, "FAILED: de-framing\n");
+		failures++;
+	}
+
+	// Conditioning straight from the bulk-in transfers gives the same output, the trailing status byte is kept apart
+	framedCnt = ftdi_frame(raw, blockWords * 4 * 4 + 1, framed);
+	tl_cond_initializeNonce(&shaData, BENCH_DEVICE_ID, 0);
+	tl_sha256_initializeSerialNumber(&shaData, 0);
+	tl_cond_streamStart(&cs, &shaData, condHmac, blockWords, blockWords * 4 * 4, out2);
+	split = framedCnt > packetSize ? packetSize : framedCnt;
+	cnt = tl_ftdi_deframeToStream(framed, split, packetSize, &cs, 0, blockWords * 4 * 4 + 1);
+	tl_cond_streamRestart(&cs);
+	cnt = tl_ftdi_deframeToStream(framed, split, packetSize, &cs, 0, blockWords * 4 * 4 + 1);
+	cnt = tl_ftdi_deframeToStream(framed + split, framedCnt - split, packetSize, &cs, cnt, blockWords * 4 * 4 + 1);
+	if (cnt != blockWords * 4 * 4 + 1 || cs.outWords != TL_SHA256_OUT_WORDS * 4 || memcmp(out1, out2, sizeof(out1)) != 0
+			|| cs.tailBytes != 1 || cs.tail[0] != raw[blockWords * 4 * 4]) {
+		fprintf(stderr, "FAILED: stream conditioning\n");
+		failures++;
+	}
+
+	// The conditioning profiles of the module declare 1000, 999 and 499 per mille at 500 per mille of raw entropy,
+	// and only the 4:1 profile is counted as full
+	if (tl_cond_entropyPerMille(TL_SHA256_OUT_WORDS * 4, 500) != 1000 || tl_cond_entropyPerMille(16, 500) != 999
+			|| tl_cond_entropyPerMille(TL_SHA256_OUT_WORDS, 500) != 499 || tl_cond_entropyPerMille(TL_SHA256_OUT_WORDS * 4, 313) != 1000
+			|| tl_cond_entropyPerMille(TL_SHA256_OUT_WORDS * 4, 312) != 999 || tl_cond_entropyPerMille(16, 1000) != 1000) {
+		fprintf(stderr, "FAILED: declared conditioning entropy\n");
+		failures++;
+	}
+
+	// Health tests pass random data and fail stuck-at data
+	tl_rct_initialize(&rctData, BENCH_FAIL_THRESHOLD);
+	tl_apt_initialize(&aptData, BENCH_FAIL_THRESHOLD);
+	tl_health_sampleBuffer(&rctData, &aptData, (uint8_t *)out1, sizeof(out1));
+	if (rctData.statusByte != SUCCESS || aptData.statusByte != SUCCESS) {
+		fprintf(stderr, "FAILED: health tests reject conditioned data\n");
+		failures++;
+	}
+	memset(raw, 0x55, sizeof(raw));
+	tl_rct_initialize(&rctData, BENCH_FAIL_THRESHOLD);
+	tl_apt_initialize(&aptData, BENCH_FAIL_THRESHOLD);
+	tl_health_sampleBuffer(&rctData, &aptData, raw, sizeof(raw));
+	if (rctData.statusByte != rctData.signature) {
+		fprintf(stderr, "FAILED: Repetition Count Test accepts stuck-at data\n");
+		failures++;
+	}
+	if (aptData.statusByte != aptData.signature) {
+		fprintf(stderr, "FAILED: Adaptive Proportion Test accepts stuck-at data\n");
+		failures++;
+	}
+
+	// A stuck-at noise source fails the health tests of the raw bytes at the startup, the nonce makes its
+	// conditioned output pass the tests of the output
+	memset(raw, 0x55, sizeof(raw));
+	tl_rct_initialize(&rctData, BENCH_FAIL_THRESHOLD);
+	tl_apt_initialize(&aptData, BENCH_FAIL_THRESHOLD);
+	tl_health_setRawCutoffs(&rctData, &aptData, 500);
+	tl_cond_initializeNonce(&shaData, BENCH_DEVICE_ID, 0);
+	tl_cond_streamStart(&cs, &shaData, condHmac, blockWords, sizeof(raw) / (blockWords * 4) * blockWords * 4, (uint32_t *)deframed);
+	tl_cond_streamTestRaw(&cs, &rctData, &aptData);
+	tl_cond_streamFeed(&cs, raw, sizeof(raw));
+	if (rctData.statusByte != rctData.signature || aptData.statusByte != aptData.signature) {
+		fprintf(stderr, "FAILED: startup health tests accept stuck-at raw bytes\n");
+		failures++;
+	}
+	tl_rct_initialize(&rctData, BENCH_FAIL_THRESHOLD);
+	tl_apt_initialize(&aptData, BENCH_FAIL_THRESHOLD);
+	tl_health_sampleBuffer(&rctData, &aptData, deframed, cs.outWords * 4);
+	if (rctData.statusByte != SUCCESS || aptData.statusByte != SUCCESS) {
+		fprintf(stderr, "FAILED: health tests reject the conditioned output of stuck-at raw bytes\n");
+		failures++;
+	}
+	// Raw bytes with more entropy than assumed pass them
+	fill_pseudo_random(raw, sizeof(raw), 2);
+	tl_rct_initialize(&rctData, BENCH_FAIL_THRESHOLD);
+	tl_apt_initialize(&aptData, BENCH_FAIL_THRESHOLD);
+	tl_health_setRawCutoffs(&rctData, &aptData, 500);
+	tl_cond_streamStart(&cs, &shaData, condHmac, blockWords, sizeof(raw) / (blockWords * 4) * blockWords * 4, (uint32_t *)deframed);
+	tl_cond_streamTestRaw(&cs, &rctData, &aptData);
+	tl_cond_streamFeed(&cs, raw, sizeof(raw));
+	if (rctData.statusByte != SUCCESS || aptData.statusByte != SUCCESS) {
+		fprintf(stderr, "FAILED: startup health tests reject random raw bytes\n");
+		failures++;
+	}
+
+	failures += check_reservoir();
+
+	return failures;
+}
+
+/**
+ * Run one processing stage over the benchmark buffers
+ *
+ * @param enum bench_stage stage - the stage to run
+ * @param int length - raw input size in bytes
+ *
+ */
+static void run_stage(enum bench_stage stage, int length) {
+	int outLength = length / (blockWords * 4) * TL_SHA256_OUT_WORDS * 4;
+
+	switch (stage) {
+	case STAGE_DEFRAME:
+		tl_ftdi_deframe(framedBuff, framedLength, packetSize, rawBuff, 0, length);
+		break;
+	case STAGE_CONDITION:
+		tl_cond_conditionWords(&shaData, condHmac, (uint32_t *)rawBuff, length / 4, blockWords, (uint32_t *)condBuff);
+		break;
+	case STAGE_RCT:
+		tl_rct_restart(&rctData);
+		for (int i = 0; i < length; i++) {
+			tl_rct_sample(&rctData, rawBuff[i]);
+		}
+		break;
+	case STAGE_APT:
+		tl_apt_restart(&aptData);
+		for (int i = 0; i < length; i++) {
+			tl_apt_sample(&aptData, rawBuff[i]);
+		}
+		break;
+	case STAGE_PIPELINE:
+		tl_ftdi_deframe(framedBuff, framedLength, packetSize, rawBuff, 0, length);
+		tl_cond_conditionWords(&shaData, condHmac, (uint32_t *)rawBuff, length / 4, blockWords, (uint32_t *)condBuff);
+		tl_rct_restart(&rctData);
+		tl_apt_restart(&aptData);
+		tl_health_sampleBuffer(&rctData, &aptData, condBuff, outLength);
+		break;
+	case STAGE_STREAM:
+		tl_cond_streamStart(&condStream, &shaData, condHmac, blockWords, length, (uint32_t *)condBuff);
+		tl_ftdi_deframeToStream(framedBuff, framedLength, packetSize, &condStream, 0, length);
+		tl_rct_restart(&rctData);
+		tl_apt_restart(&aptData);
+		tl_health_sampleBuffer(&rctData, &aptData, condBuff, outLength);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Measure one processing stage and print the results
+ *
+ * @param enum bench_stage stage - the stage to measure
+ * @param int length - raw input size in bytes
+ *
+ */
+static void bench_stage(enum bench_stage stage, int length) {
+	uint64_t startNs, elapsedNs;
+	uint64_t startCycles, elapsedCycles;
+	uint64_t iterations = 0;
+	double bytes;
+	double mbps;
+	double cpb;
+
+	// Warm up the caches
+	run_stage(stage, length);
+
+	startNs = now_nsecs();
+	startCycles = now_cycles();
+	do {
+		run_stage(stage, length);
+		iterations++;
+		elapsedNs = now_nsecs() - startNs;
+	} while (elapsedNs < (uint64_t)minRunMsecs * 1000000ULL);
+	elapsedCycles = now_cycles() - startCycles;
+
+	bytes = (double)length * iterations;
+	mbps = bytes / ((double)elapsedNs / 1e9) / 1e6;
+	cpb = elapsedCycles ? (double)elapsedCycles / bytes : 0;
+
+	if (csvOutput) {
+		printf("%s,%d,%d,%.2f,%.2f\n", stageNames[stage], length, blockWords, mbps, cpb);
+	} else if (elapsedCycles) {
+		printf("%-10s %9d %12.2f %12.2f\n", stageNames[stage], length, mbps, cpb);
+	} else {
+		printf("%-10s %9d %12.2f %12s\n", stageNames[stage], length, mbps, "-");
+	}
+}
+
+/**
+ * Print the program usage
+ *
+ * @param const char *name - the program name
+ *
+ */
+static void print_usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-w words] [-m] [-p packet size] [-t msecs] [-c]\n", name);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	int maxSize;
+	int failures;
+	unsigned int i;
+	int stage;
+
+	while ((opt = getopt(argc, argv, "w:mp:t:c")) != -1) {
+		switch (opt) {
+		case 'w':
+			blockWords = atoi(optarg);
+			break;
+		case 'm':
+			condHmac = &hmacData;
+			break;
+		case 'p':
+			packetSize = atoi(optarg);
+			break;
+		case 't':
+			minRunMsecs = atoi(optarg);
+			break;
+		case 'c':
+			csvOutput = 1;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (blockWords < 1 || blockWords > TL_COND_MAX_INPUT_WORDS || packetSize <= TL_FTDI_STATUS_BYTES || minRunMsecs < 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	failures = run_checks();
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	maxSize = benchSizes[NUM_BENCH_SIZES - 1];
+	rawBuff = malloc(maxSize);
+	condBuff = malloc(maxSize);
+	framedBuff = malloc(maxSize * 2 + packetSize);
+	if (rawBuff == NULL || condBuff == NULL || framedBuff == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	tl_cond_initializeNonce(&shaData, BENCH_DEVICE_ID, 0);
+	tl_sha256_initializeSerialNumber(&shaData, 0);
+	tl_rct_initialize(&rctData, BENCH_FAIL_THRESHOLD);
+	tl_apt_initialize(&aptData, BENCH_FAIL_THRESHOLD);
+
+	if (csvOutput) {
+		printf("stage,bytes,block_words,mb_per_sec,cycles_per_byte\n");
+	} else {
+		printf("All checks passed, %d words per output block, %s, %d byte packets\n\n", blockWords, condHmac ? "HMAC-SHA256" : "SHA-256", packetSize);
+		printf("%-10s %9s %12s %12s\n", "stage", "bytes", "MB/s", "cycles/byte");
+	}
+
+	for (i = 0; i < NUM_BENCH_SIZES; i++) {
+		// Round down to whole conditioning blocks
+		int length = benchSizes[i] / (blockWords * 4) * (blockWords * 4);
+
+		fill_pseudo_random(rawBuff, length, 2463534242U);
+		framedLength = ftdi_frame(rawBuff, length, framedBuff);
+		for (stage = 0; stage < NUM_STAGES; stage++) {
+			bench_stage(stage, length);
+		}
+	}
+
+	free(rawBuff);
+	free(condBuff);
+	free(framedBuff);
+	return 0;
+}
@@ -0,0 +1,1127 @@
+/*
+ * tlcond.h
+ * ver. 2.3
+ *
+ */
+
+/*
+ * TL100/TL200 conditioning and health test logic - 2.3
+ *
+ * Copyright (C) 2014-2016 TectroLabs, http://tectrolabs.com
+ *
+ * This file contains the pure computation parts of the 'tlrandom' kernel
+ * module: the SHA-256 and HMAC-SHA256 conditioning functions, the Repetition Count and the
+ * Adaptive Proportion health tests and the de-framing of the FTDI bulk-in
+ * packets.
+ *
+ * Nothing in here depends on kernel services, so the same code is built
+ * into the kernel module and into user space tools such as 'tlbench'.
+ * All the state is kept in structures owned by the caller.
+ *
+ */
+
+#ifndef TLCOND_H_
+#define TLCOND_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#endif
+
+// Number of 32 bit words in a SHA-256 data block
+#define TL_SHA256_BLOCK_WORDS (16)
+
+// Number of 32 bit words in a SHA-256 hash value
+#define TL_SHA256_OUT_WORDS (8)
+
+// Maximum number of 32 bit input words hashed into one output block, not including the nonce
+#define TL_COND_MAX_INPUT_WORDS (32)
+
+// Number of nonce words stamped after the data of every block: device ID, boot seed, slice and counter
+#define TL_COND_NONCE_WORDS (4)
+
+// Number of status bytes the FTDI chip puts in front of every bulk-in packet
+#define TL_FTDI_STATUS_BYTES (2)
+
+#define TL_ROTR(n, x) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t tl_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// FIPS PUB 180-2 appendix B.2 and B.3 style test vectors, big-endian 32 bit words
+static const uint32_t tl_sha256_katMsg1[14] = {
+	0x61626364, 0x62636465, 0x63646566, 0x64656667, 0x65666768, 0x66676869, 0x6768696a,
+	0x68696a6b, 0x696a6b6c, 0x6a6b6c6d, 0x6b6c6d6e, 0x6c6d6e6f, 0x6d6e6f70, 0x6e6f7071
+};
+static const uint32_t tl_sha256_katHash1[8] = {
+	0x248d6a61, 0xd20638b8, 0xe5c02693, 0x0c3e6039, 0xa33ce459, 0x64ff2167, 0xf6ecedd4, 0x19db06c1
+};
+static const uint32_t tl_sha256_katMsg2[28] = {
+	0x61626364, 0x65666768, 0x62636465, 0x66676869, 0x63646566, 0x6768696a, 0x64656667,
+	0x68696a6b, 0x65666768, 0x696a6b6c, 0x66676869, 0x6a6b6c6d, 0x6768696a, 0x6b6c6d6e,
+	0x68696a6b, 0x6c6d6e6f, 0x696a6b6c, 0x6d6e6f70, 0x6a6b6c6d, 0x6e6f7071, 0x6b6c6d6e,
+	0x6f707172, 0x6c6d6e6f, 0x70717273, 0x6d6e6f70, 0x71727374, 0x6e6f7071, 0x72737475
+};
+static const uint32_t tl_sha256_katHash2[8] = {
+	0xcf5b16a7, 0x78af8380, 0x036ce59e, 0x7b049237, 0x0b249b11, 0xe8f07a51, 0xafac4503, 0x7afee9d1
+};
+
+// Key of the HMAC-SHA256 conditioning, "TectroLabs TL100/TL200 condition". SP 800-90B
+// section 3.1.5.1.1 allows any key for a vetted conditioning function, it need not be secret.
+static const uint32_t tl_cond_hmacKey[8] = {
+	0x54656374, 0x726f4c61, 0x62732054, 0x4c313030, 0x2f544c32, 0x30302063, 0x6f6e6469, 0x74696f6e
+};
+
+// RFC 4231 test case 2, key "Jefe" and data "what do ya want for nothing?"
+static const uint32_t tl_hmac_sha256_katKey[1] = {
+	0x4a656665
+};
+static const uint32_t tl_hmac_sha256_katMsg[7] = {
+	0x77686174, 0x20646f20, 0x79612077, 0x616e7420, 0x666f7220, 0x6e6f7468, 0x696e673f
+};
+static const uint32_t tl_hmac_sha256_katHash[8] = {
+	0x5bdcc146, 0xbf60754e, 0x6a042426, 0x089575c7, 0x5a003f08, 0x9d273983, 0x9dec58b9, 0x64ec3843
+};
+
+// Message schedule of the last block, prepared once for messages of 'len' words. The last block
+// holds 'varWords' message words followed by the constant padding, 'w' is its whole schedule when
+// there are none, otherwise the part of it the padding contributes.
+struct tl_sha256_tail {
+	int16_t len;
+	uint8_t varWords;
+	uint32_t w[64];
+};
+
+// SHA-256 working data
+struct tl_sha256_data {
+	uint32_t w[64];
+	uint32_t h0, h1, h2, h3, h4, h5, h6, h7;
+	// The nonce, 'blockSerialNumber' counts the blocks of this slice
+	uint32_t blockSerialNumber;
+	uint32_t deviceId;
+	uint32_t bootSeed;
+	uint32_t sliceId;
+	bool isSeeded;
+	uint32_t srcToHash[TL_COND_MAX_INPUT_WORDS + TL_COND_NONCE_WORDS];
+	struct tl_sha256_tail tail;
+};
+
+// HMAC-SHA256 key state, the hash values after the inner and the outer key blocks
+struct tl_hmac_sha256 {
+	uint32_t innerState[TL_SHA256_OUT_WORDS];
+	uint32_t outerState[TL_SHA256_OUT_WORDS];
+	struct tl_sha256_tail innerTail;
+	struct tl_sha256_tail outerTail;
+};
+
+// Health test parameters. Defining TL_HEALTH_FAIL_THRESHOLD before including
+// this file fixes the failure threshold too, otherwise it is kept in the test data.
+#define TL_RCT_MAX_REPETITIONS (5)
+#define TL_APT_WINDOW_SIZE (64)
+#define TL_APT_CUTOFF_VALUE (5)
+// Window of the Adaptive Proportion Test on raw bytes, NIST SP 800-90B section 4.4.2 for non-binary data
+#define TL_APT_RAW_WINDOW_SIZE (512)
+
+#ifdef TL_HEALTH_FAIL_THRESHOLD
+#define tl_health_failThreshold(t) (TL_HEALTH_FAIL_THRESHOLD)
+#else
+#define tl_health_failThreshold(t) ((t)->failThreshold)
+#endif
+
+// Repetition Count Test data, NIST SP 800-90B section 4.4.1
+struct tl_rct_data {
+	uint8_t statusByte;
+	uint8_t signature;
+	bool isInitialized;
+	uint8_t lastSample;
+	uint16_t maxRepetitions;
+	uint16_t curRepetitions;
+	uint16_t failureWindow;
+	uint16_t failureCount;
+	uint16_t failThreshold;
+};
+
+// Adaptive Proportion Test data, NIST SP 800-90B section 4.4.2
+struct tl_apt_data {
+	uint8_t statusByte;
+	uint8_t signature;
+	bool isInitialized;
+	uint8_t firstSample;
+	uint16_t windowSize;
+	uint16_t cutoffValue;
+	uint16_t curRepetitions;
+	uint16_t curSamples;
+	uint16_t cycleFailures;
+	uint16_t failThreshold;
+};
+
+/**
+ * FIPS PUB 180-4 section 4.1.2 formula (4.2)
+ *
+ * @param uint32_t x
+ * @param uint32_t y
+ * @param uint32_t z
+ * $return uint32_t Ch value
+ *
+ */
+static inline uint32_t tl_sha256_ch(uint32_t x, uint32_t y, uint32_t z) {
+	return (x & y) ^ (~x & z);
+}
+
+/**
+ * FIPS PUB 180-4 section 4.1.2 formula (4.3)
+ *
+ * @param uint32_t x
+ * @param uint32_t y
+ * @param uint32_t z
+ * $return uint32_t Maj value
+ *
+ */
+static inline uint32_t tl_sha256_maj(uint32_t x, uint32_t y, uint32_t z) {
+	return (x & y) ^ (x & z) ^ (y & z);
+}
+
+/**
+ * FIPS PUB 180-4 section 4.1.2 formula (4.4)
+ *
+ * @param uint32_t x
+ * $return uint32_t Sum0 value
+ *
+ */
+static inline uint32_t tl_sha256_sum0(uint32_t x) {
+	return TL_ROTR(2, x) ^ TL_ROTR(13, x) ^ TL_ROTR(22, x);
+}
+
+/**
+ * FIPS PUB 180-4 section 4.1.2 formula (4.5)
+ *
+ * @param uint32_t x
+ * $return uint32_t Sum1 value
+ *
+ */
+static inline uint32_t tl_sha256_sum1(uint32_t x) {
+	return TL_ROTR(6, x) ^ TL_ROTR(11, x) ^ TL_ROTR(25, x);
+}
+
+/**
+ * FIPS PUB 180-4 section 4.1.2 formula (4.6)
+ *
+ * @param uint32_t x
+ * $return uint32_t sigma0 value
+ *
+ */
+static inline uint32_t tl_sha256_sigma0(uint32_t x) {
+	return TL_ROTR(7, x) ^ TL_ROTR(18, x) ^ (x >> 3);
+}
+
+/**
+ * FIPS PUB 180-4 section 4.1.2 formula (4.7)
+ *
+ * @param uint32_t x
+ * $return uint32_t sigma1 value
+ *
+ */
+static inline uint32_t tl_sha256_sigma1(uint32_t x) {
+	return TL_ROTR(17, x) ^ TL_ROTR(19, x) ^ (x >> 10);
+}
+
+/**
+ * Initialize the SHA256 data
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ *
+ */
+static inline void tl_sha256_initialize(struct tl_sha256_data *sd) {
+	// Initialize H0, H1, H2, H3, H4, H5, H6 and H7
+	sd->h0 = 0x6a09e667;
+	sd->h1 = 0xbb67ae85;
+	sd->h2 = 0x3c6ef372;
+	sd->h3 = 0xa54ff53a;
+	sd->h4 = 0x510e527f;
+	sd->h5 = 0x9b05688c;
+	sd->h6 = 0x1f83d9ab;
+	sd->h7 = 0x5be0cd19;
+}
+
+/**
+ * Initialize the serial number for hashing
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param uint32_t initValue - a startup random number for generating serial number for hashing
+ *
+ */
+static inline void tl_sha256_initializeSerialNumber(struct tl_sha256_data *sd, uint32_t initValue) {
+	sd->blockSerialNumber = initValue;
+	sd->tail.len = 0;
+}
+
+/**
+ * Initialize the nonce of a conditioning slice. Every 'tl_sha256_data' is a slice with a counter of
+ * its own, so slices conditioning in parallel never share a counter. The boot seed is taken from the
+ * first raw block the slice conditions, so two hosts or two loads of the module start apart.
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param uint32_t deviceId - identifies the device the raw data comes from
+ * @param uint32_t sliceId - identifies the slice among those conditioning data of the same device
+ *
+ */
+static inline void tl_cond_initializeNonce(struct tl_sha256_data *sd, uint32_t deviceId, uint32_t sliceId) {
+	sd->deviceId = deviceId;
+	sd->sliceId = sliceId;
+	sd->bootSeed = 0;
+	sd->isSeeded = false;
+}
+
+/**
+ * Stamp the nonce of a new input data block into the words that follow the data
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param uint32_t *inputBlock - pointer to the input hashing block
+ * @param int numWords - number of data words in the input hashing block
+ *
+ */
+static inline void tl_sha256_stampSerialNumber(struct tl_sha256_data *sd, uint32_t *inputBlock, int numWords) {
+	int i;
+
+	if (!sd->isSeeded) {
+		for (i = 0; i < numWords; i++) {
+			sd->bootSeed = sd->bootSeed * 0x9e3779b1 + inputBlock[i];
+		}
+		sd->isSeeded = true;
+	}
+	inputBlock[numWords] = sd->deviceId;
+	inputBlock[numWords + 1] = sd->bootSeed;
+	inputBlock[numWords + 2] = sd->sliceId;
+	inputBlock[numWords + 3] = sd->blockSerialNumber++;
+}
+
+/**
+ * Run the 64 rounds of the compression function over a prepared message schedule
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param const uint32_t *w - the 64 words of the message schedule
+ *
+ */
+static inline void tl_sha256_compress(struct tl_sha256_data *sd, const uint32_t *w) {
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t tmp1, tmp2;
+	uint8_t t;
+
+	// Initialize variables, kept in locals so they are not stored back after every round
+	a = sd->h0;
+	b = sd->h1;
+	c = sd->h2;
+	d = sd->h3;
+	e = sd->h4;
+	f = sd->h5;
+	g = sd->h6;
+	h = sd->h7;
+
+	// Process elements 0...63
+	for (t = 0; t <= 63; t++) {
+		tmp1 = h + tl_sha256_sum1(e) + tl_sha256_ch(e, f, g) + tl_sha256_k[t] + w[t];
+		tmp2 = tl_sha256_sum0(a) + tl_sha256_maj(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + tmp1;
+		d = c;
+		c = b;
+		b = a;
+		a = tmp1 + tmp2;
+	}
+
+	// Calculate the final hash for the block
+	sd->h0 += a;
+	sd->h1 += b;
+	sd->h2 += c;
+	sd->h3 += d;
+	sd->h4 += e;
+	sd->h5 += f;
+	sd->h6 += g;
+	sd->h7 += h;
+}
+
+/**
+ * Hash current block
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ *
+ */
+static inline void tl_sha256_hashCurrentBlock(struct tl_sha256_data *sd) {
+	uint8_t t;
+
+	// Process elements 16...63
+	for (t = 16; t <= 63; t++) {
+		sd->w[t] = tl_sha256_sigma1(sd->w[t-2]) + sd->w[t-7] + tl_sha256_sigma0(sd->w[t-15]) + sd->w[t-16];
+	}
+
+	tl_sha256_compress(sd, sd->w);
+}
+
+/**
+ * Prepare the message schedule of the last block for messages of 'len' words. The padding of a
+ * fixed length message is the same for every message, so the schedule words that only depend on it
+ * are expanded once here instead of for every hash.
+ *
+ * @param struct tl_sha256_tail *tail - the schedule to prepare
+ * @param int16_t len - number of 32 bit words in the message, including any blocks hashed before it
+ *
+ */
+static inline void tl_sha256_prepareTail(struct tl_sha256_tail *tail, int16_t len) {
+	uint32_t pad[TL_SHA256_BLOCK_WORDS];
+	int varWords;
+	int reminder;
+	int t;
+
+	reminder = len % TL_SHA256_BLOCK_WORDS;
+	memset(pad, 0, sizeof(pad));
+	if (reminder >= TL_SHA256_BLOCK_WORDS - 2) {
+		// The '1' marker ends the last data block, the length goes in a block of its own
+		varWords = 0;
+	} else if (reminder == 0) {
+		varWords = 0;
+		pad[0] = 0x80000000;
+	} else {
+		varWords = reminder;
+		pad[varWords] = 0x80000000;
+	}
+	pad[TL_SHA256_BLOCK_WORDS - 1] = (uint32_t)len * 8 * 4;
+
+	memset(tail->w, 0, sizeof(tail->w));
+	memcpy(tail->w, pad, sizeof(pad));
+	for (t = 16; t <= 63; t++) {
+		if (varWords == 0) {
+			tail->w[t] = tl_sha256_sigma1(tail->w[t-2]) + tail->w[t-7] + tl_sha256_sigma0(tail->w[t-15]) + tail->w[t-16];
+			continue;
+		}
+		if (t > 30) {
+			// From element 31 on every term depends on the message
+			break;
+		}
+		// Only the terms taken from the padding words, the rest is added per message
+		if (t - 2 >= varWords && t - 2 < TL_SHA256_BLOCK_WORDS) {
+			tail->w[t] += tl_sha256_sigma1(pad[t-2]);
+		}
+		if (t - 7 >= varWords && t - 7 < TL_SHA256_BLOCK_WORDS) {
+			tail->w[t] += pad[t-7];
+		}
+		if (t - 15 >= varWords && t - 15 < TL_SHA256_BLOCK_WORDS) {
+			tail->w[t] += tl_sha256_sigma0(pad[t-15]);
+		}
+		if (t - 16 >= varWords && t - 16 < TL_SHA256_BLOCK_WORDS) {
+			tail->w[t] += pad[t-16];
+		}
+	}
+	tail->varWords = varWords;
+	tail->len = len;
+}
+
+/**
+ * Hash the last block of a message using the schedule prepared by tl_sha256_prepareTail()
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param const struct tl_sha256_tail *tail - the prepared schedule
+ * @param const uint32_t *src - the message words of the last block, 'varWords' of them
+ *
+ */
+static inline void tl_sha256_hashTailBlock(struct tl_sha256_data *sd, const struct tl_sha256_tail *tail, const uint32_t *src) {
+	const int varWords = tail->varWords;
+	uint32_t *w = sd->w;
+	int t;
+
+	if (varWords == 0) {
+		tl_sha256_compress(sd, tail->w);
+		return;
+	}
+
+	for (t = 0; t < varWords; t++) {
+		w[t] = src[t];
+	}
+	for (; t < TL_SHA256_BLOCK_WORDS; t++) {
+		w[t] = tail->w[t];
+	}
+	// Up to element 30 some of the terms come from the padding and are already in 'tail'
+	for (t = 16; t <= 30; t++) {
+		w[t] = tail->w[t];
+		if (t - 2 < varWords || t - 2 >= TL_SHA256_BLOCK_WORDS) {
+			w[t] += tl_sha256_sigma1(w[t-2]);
+		}
+		if (t - 7 < varWords || t - 7 >= TL_SHA256_BLOCK_WORDS) {
+			w[t] += w[t-7];
+		}
+		if (t - 15 < varWords) {
+			w[t] += tl_sha256_sigma0(w[t-15]);
+		}
+		if (t - 16 < varWords) {
+			w[t] += w[t-16];
+		}
+	}
+	for (; t <= 63; t++) {
+		w[t] = tl_sha256_sigma1(w[t-2]) + w[t-7] + tl_sha256_sigma0(w[t-15]) + w[t-16];
+	}
+	tl_sha256_compress(sd, w);
+}
+
+/**
+ * Hash a message into the current hash values, padding it as the end of a longer message
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param struct tl_sha256_tail *tail - the last block schedule, prepared here when not done yet
+ * @param const uint32_t *src - pointer to an array of 32 bit words used as hash input
+ * @param int16_t len - number of 32 bit words available in array pointed by 'src'
+ * @param int16_t totalLen - number of 32 bit words in the whole message, 'len' and the blocks hashed before
+ *
+ */
+static inline void tl_sha256_hashWords(struct tl_sha256_data *sd, struct tl_sha256_tail *tail, const uint32_t *src, int16_t len, int16_t totalLen) {
+	uint16_t blockNum;
+	uint8_t ui8;
+	uint16_t numCompleteDataBlocks;
+	uint16_t reminder;
+	uint16_t srcOffset;
+
+	if (tail->len != totalLen) {
+		tl_sha256_prepareTail(tail, totalLen);
+	}
+
+	numCompleteDataBlocks = len / TL_SHA256_BLOCK_WORDS;
+	reminder = len % TL_SHA256_BLOCK_WORDS;
+
+	// Process complete blocks
+	for (blockNum = 0; blockNum < numCompleteDataBlocks; blockNum++) {
+		srcOffset = blockNum * TL_SHA256_BLOCK_WORDS;
+		for (ui8 = 0; ui8 < TL_SHA256_BLOCK_WORDS; ui8++) {
+			sd->w[ui8] = src[ui8 + srcOffset];
+		}
+		// Hash the current block
+		tl_sha256_hashCurrentBlock(sd);
+	}
+
+	srcOffset = numCompleteDataBlocks * TL_SHA256_BLOCK_WORDS;
+	if (reminder >= TL_SHA256_BLOCK_WORDS - 2) {
+		// No room left for the message size, the last data block only gets the '1' marker
+		for (ui8 = 0; ui8 < reminder; ui8++) {
+			sd->w[ui8] = src[ui8 + srcOffset];
+		}
+		sd->w[ui8++] = 0x80000000;
+		for (; ui8 < TL_SHA256_BLOCK_WORDS; ui8++) {
+			sd->w[ui8] = 0x0;
+		}
+		tl_sha256_hashCurrentBlock(sd);
+	}
+
+	// The block with the message size
+	tl_sha256_hashTailBlock(sd, tail, src + srcOffset);
+}
+
+/**
+ * Copy the current hash values
+ *
+ * @param const struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param uint32_t *dst - pointer to an array of 8 X 32 bit words
+ *
+ */
+static inline void tl_sha256_saveState(const struct tl_sha256_data *sd, uint32_t *dst) {
+	dst[0] = sd->h0;
+	dst[1] = sd->h1;
+	dst[2] = sd->h2;
+	dst[3] = sd->h3;
+	dst[4] = sd->h4;
+	dst[5] = sd->h5;
+	dst[6] = sd->h6;
+	dst[7] = sd->h7;
+}
+
+/**
+ * Set the current hash values
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param const uint32_t *src - pointer to an array of 8 X 32 bit words
+ *
+ */
+static inline void tl_sha256_loadState(struct tl_sha256_data *sd, const uint32_t *src) {
+	sd->h0 = src[0];
+	sd->h1 = src[1];
+	sd->h2 = src[2];
+	sd->h3 = src[3];
+	sd->h4 = src[4];
+	sd->h5 = src[5];
+	sd->h6 = src[6];
+	sd->h7 = src[7];
+}
+
+/**
+ * Generate SHA256 value.
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param const uint32_t* src - pointer to an array of 32 bit words used as hash input
+ * @param int16_t len - number of 32 bit words available in array pointed by 'src'
+ * @param uint32_t dst - pointer to an array of 8 X 32 bit words used as hash output
+ *
+ * @return int 0 for successful operation, -1 for invalid parameters
+ *
+ */
+static inline int tl_sha256_generateHash(struct tl_sha256_data *sd, const uint32_t *src, int16_t len, uint32_t *dst) {
+	if (len <= 0) {
+		return -1;
+	}
+
+	tl_sha256_initialize(sd);
+	tl_sha256_hashWords(sd, &sd->tail, src, len, len);
+
+	// Save the results
+	tl_sha256_saveState(sd, dst);
+
+	return 0;
+}
+
+/**
+ * Set the HMAC-SHA256 key. The key blocks are hashed once here, every HMAC then starts from the
+ * saved hash values.
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param struct tl_hmac_sha256 *hm - the key state to set
+ * @param const uint32_t *key - the key, big-endian 32 bit words
+ * @param int keyWords - number of key words, at most TL_SHA256_BLOCK_WORDS
+ *
+ */
+static inline void tl_hmac_sha256_initialize(struct tl_sha256_data *sd, struct tl_hmac_sha256 *hm, const uint32_t *key, int keyWords) {
+	int i;
+
+	for (i = 0; i < TL_SHA256_BLOCK_WORDS; i++) {
+		sd->w[i] = (i < keyWords ? key[i] : 0) ^ 0x36363636;
+	}
+	tl_sha256_initialize(sd);
+	tl_sha256_hashCurrentBlock(sd);
+	tl_sha256_saveState(sd, hm->innerState);
+
+	for (i = 0; i < TL_SHA256_BLOCK_WORDS; i++) {
+		sd->w[i] = (i < keyWords ? key[i] : 0) ^ 0x5c5c5c5c;
+	}
+	tl_sha256_initialize(sd);
+	tl_sha256_hashCurrentBlock(sd);
+	tl_sha256_saveState(sd, hm->outerState);
+
+	hm->innerTail.len = 0;
+	hm->outerTail.len = 0;
+	memset(sd->w, 0, sizeof(sd->w));
+}
+
+/**
+ * Generate HMAC-SHA256 value, RFC 2104
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param struct tl_hmac_sha256 *hm - the key state
+ * @param const uint32_t* src - pointer to an array of 32 bit words used as input
+ * @param int16_t len - number of 32 bit words available in array pointed by 'src'
+ * @param uint32_t dst - pointer to an array of 8 X 32 bit words used as output
+ *
+ * @return int 0 for successful operation, -1 for invalid parameters
+ *
+ */
+static inline int tl_hmac_sha256_generate(struct tl_sha256_data *sd, struct tl_hmac_sha256 *hm, const uint32_t *src, int16_t len, uint32_t *dst) {
+	uint32_t inner[TL_SHA256_OUT_WORDS];
+
+	if (len <= 0) {
+		return -1;
+	}
+
+	tl_sha256_loadState(sd, hm->innerState);
+	tl_sha256_hashWords(sd, &hm->innerTail, src, len, len + TL_SHA256_BLOCK_WORDS);
+	tl_sha256_saveState(sd, inner);
+
+	tl_sha256_loadState(sd, hm->outerState);
+	tl_sha256_hashWords(sd, &hm->outerTail, inner, TL_SHA256_OUT_WORDS, TL_SHA256_OUT_WORDS + TL_SHA256_BLOCK_WORDS);
+	tl_sha256_saveState(sd, dst);
+
+	return 0;
+}
+
+/**
+ * Run the known answer tests for checking the SHA algorithm implementation
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @return int 0 for successful operation
+ *
+ */
+static inline int tl_sha256_knownAnswerTest(struct tl_sha256_data *sd) {
+	uint32_t results[TL_SHA256_OUT_WORDS];
+	int retVal;
+
+	retVal = tl_sha256_generateHash(sd, tl_sha256_katMsg1, 14, results);
+	if (retVal == 0) {
+		retVal = memcmp(results, tl_sha256_katHash1, sizeof(results));
+	}
+	if (retVal == 0) {
+		retVal = tl_sha256_generateHash(sd, tl_sha256_katMsg2, 28, results);
+	}
+	if (retVal == 0) {
+		retVal = memcmp(results, tl_sha256_katHash2, sizeof(results));
+	}
+	return retVal;
+}
+
+/**
+ * Run the known answer test for checking the HMAC-SHA256 implementation. The key state is
+ * overwritten, set the conditioning key again afterwards.
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param struct tl_hmac_sha256 *hm - the key state used by the test
+ * @return int 0 for successful operation
+ *
+ */
+static inline int tl_hmac_sha256_knownAnswerTest(struct tl_sha256_data *sd, struct tl_hmac_sha256 *hm) {
+	uint32_t results[TL_SHA256_OUT_WORDS];
+	int retVal;
+
+	tl_hmac_sha256_initialize(sd, hm, tl_hmac_sha256_katKey, 1);
+	retVal = tl_hmac_sha256_generate(sd, hm, tl_hmac_sha256_katMsg, 7, results);
+	if (retVal == 0) {
+		retVal = memcmp(results, tl_hmac_sha256_katHash, sizeof(results));
+	}
+	return retVal;
+}
+
+/**
+ * Stamp the nonce after the block staged in 'srcToHash' and hash it into one output block
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param struct tl_hmac_sha256 *hm - the HMAC key state, NULL for plain SHA-256
+ * @param int blockWords - number of raw words in the block
+ * @param uint32_t *dst - pointer to the TL_SHA256_OUT_WORDS output words
+ *
+ */
+static inline void tl_cond_hashBlock(struct tl_sha256_data *sd, struct tl_hmac_sha256 *hm, int blockWords, uint32_t *dst) {
+	tl_sha256_stampSerialNumber(sd, sd->srcToHash, blockWords);
+	if (hm != NULL) {
+		tl_hmac_sha256_generate(sd, hm, sd->srcToHash, blockWords + TL_COND_NONCE_WORDS, dst);
+	} else {
+		tl_sha256_generateHash(sd, sd->srcToHash, blockWords + TL_COND_NONCE_WORDS, dst);
+	}
+}
+
+/**
+ * Condition raw random words into SHA-256 output blocks. Every 'blockWords'
+ * input words are stamped with the next serial number and hashed into
+ * TL_SHA256_OUT_WORDS output words, with HMAC-SHA256 when 'hm' is set.
+ *
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 working data
+ * @param struct tl_hmac_sha256 *hm - the HMAC key state, NULL for plain SHA-256
+ * @param const uint32_t *src - pointer to the raw random words
+ * @param int numWords - number of raw random words, a multiple of 'blockWords'
+ * @param int blockWords - number of raw words hashed into one output block
+ * @param uint32_t *dst - pointer to the output buffer
+ * @return int number of 32 bit words written to 'dst'
+ *
+ */
+static inline int tl_cond_conditionWords(struct tl_sha256_data *sd, struct tl_hmac_sha256 *hm, const uint32_t *src, int numWords, int blockWords, uint32_t *dst) {
+	int i, j;
+	int outWords = 0;
+
+	for (i = 0; i + blockWords <= numWords; i += blockWords) {
+		for (j = 0; j < blockWords; j++) {
+			sd->srcToHash[j] = src[i+j];
+		}
+		tl_cond_hashBlock(sd, hm, blockWords, dst + outWords);
+		outWords += TL_SHA256_OUT_WORDS;
+	}
+	return outWords;
+}
+
+/**
+ * Get the entropy declared for the conditioned output, following SP 800-90B section 3.1.5.1.2.
+ * The output has full entropy when the raw input of an output block carries at least 64 bits of
+ * entropy more than the block size, otherwise it has no more entropy than the input and is never
+ * counted as full.
+ *
+ * @param int blockWords - number of raw words hashed into one output block
+ * @param int rawEntropyPerMille - assumed min-entropy of the raw input per 1000 bits
+ * @return int - min-entropy per 1000 output bits
+ *
+ */
+static inline int tl_cond_entropyPerMille(int blockWords, int rawEntropyPerMille) {
+	const int outBits = TL_SHA256_OUT_WORDS * 32;
+	int inEntropyBits;
+
+	if (rawEntropyPerMille < 0) {
+		rawEntropyPerMille = 0;
+	} else if (rawEntropyPerMille > 1000) {
+		rawEntropyPerMille = 1000;
+	}
+	inEntropyBits = blockWords * 32 * rawEntropyPerMille / 1000;
+	if (inEntropyBits >= outBits + 64) {
+		return 1000;
+	}
+	return (inEntropyBits < outBits ? inEntropyBits : outBits) * 999 / outBits;
+}
+
+/**
+ * Restart the Repetition Count Test for a new buffer
+ *
+ * @param struct tl_rct_data *rct - pointer to the test data
+ *
+ */
+static inline void tl_rct_restart(struct tl_rct_data *rct) {
+	rct->isInitialized = false;
+	rct->curRepetitions = 1;
+	rct->failureWindow = 0;
+	rct->failureCount = 0;
+}
+
+/**
+ * Initialize the Repetition Count Test
+ *
+ * @param struct tl_rct_data *rct - pointer to the test data
+ * @param uint16_t failThreshold - number of consecutive failures that flag the test as failed
+ *
+ */
+static inline void tl_rct_initialize(struct tl_rct_data *rct, uint16_t failThreshold) {
+	memset(rct, 0x00, sizeof (*rct));
+	rct->statusByte = 0;
+	rct->signature = 1;
+	rct->maxRepetitions = TL_RCT_MAX_REPETITIONS;
+	rct->failThreshold = failThreshold;
+	tl_rct_restart(rct);
+}
+
+static inline void tl_rct_sample(struct tl_rct_data *rct, uint8_t value) {
+	if (!rct->isInitialized) {
+		rct->isInitialized = true;
+		rct->lastSample = value;
+	} else {
+		if (rct->lastSample == value) {
+			rct->curRepetitions++;
+			if (rct->curRepetitions >= rct->maxRepetitions) {
+				rct->curRepetitions = 1;
+				if (++rct->failureCount >= tl_health_failThreshold(rct)) {
+					if (rct->statusByte == 0) {
+						rct->statusByte = rct->signature;
+					}
+				}
+			}
+
+		} else {
+			rct->lastSample = value;
+			rct->curRepetitions = 1;
+		}
+	}
+}
+
+static inline void tl_apt_restart_cycle(struct tl_apt_data *apt) {
+	apt->cycleFailures = 0;
+}
+
+/**
+ * Restart the Adaptive Proportion Test for a new buffer
+ *
+ * @param struct tl_apt_data *apt - pointer to the test data
+ *
+ */
+static inline void tl_apt_restart(struct tl_apt_data *apt) {
+	apt->isInitialized = false;
+	tl_apt_restart_cycle(apt);
+}
+
+/**
+ * Initialize the Adaptive Proportion Test
+ *
+ * @param struct tl_apt_data *apt - pointer to the test data
+ * @param uint16_t failThreshold - number of consecutive failures that flag the test as failed
+ *
+ */
+static inline void tl_apt_initialize(struct tl_apt_data *apt, uint16_t failThreshold) {
+	memset(apt, 0x00, sizeof (*apt));
+	apt->statusByte = 0;
+	apt->signature = 2;
+	apt->windowSize = TL_APT_WINDOW_SIZE;
+	apt->cutoffValue = TL_APT_CUTOFF_VALUE;
+	apt->failThreshold = failThreshold;
+	tl_apt_restart(apt);
+}
+
+static inline void tl_apt_sample(struct tl_apt_data *apt, uint8_t value) {
+	if (!apt->isInitialized) {
+		apt->isInitialized = true;
+		apt->firstSample = value;
+		apt->curRepetitions = 0;
+		apt->curSamples = 0;
+	} else {
+		if (++apt->curSamples >= apt->windowSize) {
+			apt->isInitialized = false;
+		}
+		if (apt->firstSample == value) {
+			if (++apt->curRepetitions > apt->cutoffValue) {
+				// Check to see if we have reached the failure threshold
+				if (++apt->cycleFailures >= tl_health_failThreshold(apt)) {
+					if (apt->statusByte == 0) {
+						apt->statusByte = apt->signature;
+					}
+				}
+			} else {
+				tl_apt_restart_cycle(apt);
+			}
+		}
+	}
+}
+
+/**
+ * Run both health tests over a buffer of conditioned bytes
+ *
+ * @param struct tl_rct_data *rct - pointer to the Repetition Count Test data
+ * @param struct tl_apt_data *apt - pointer to the Adaptive Proportion Test data
+ * @param const uint8_t *buff - pointer to the bytes to test
+ * @param int length - number of bytes to test
+ *
+ */
+static inline void tl_health_sampleBuffer(struct tl_rct_data *rct, struct tl_apt_data *apt, const uint8_t *buff, int length) {
+	int i;
+
+	for (i = 0; i < length; i++) {
+		tl_rct_sample(rct, buff[i]);
+		tl_apt_sample(apt, buff[i]);
+	}
+}
+
+/**
+ * Set the cutoffs of the health tests for raw bytes of the given min-entropy, with the false positive
+ * rate of 2^-20 of NIST SP 800-90B sections 4.4.1 and 4.4.2. The Adaptive Proportion Test cutoff is
+ * taken from table 2 for the nearest entropy below, and never fails below 0.5 bits per byte.
+ *
+ * @param struct tl_rct_data *rct - pointer to the initialized Repetition Count Test data
+ * @param struct tl_apt_data *apt - pointer to the initialized Adaptive Proportion Test data
+ * @param int entropyPerMille - assumed min-entropy of the raw bytes per 1000 bits
+ *
+ */
+static inline void tl_health_setRawCutoffs(struct tl_rct_data *rct, struct tl_apt_data *apt, int entropyPerMille) {
+	// Min-entropy per byte in 1/1000 bits, and the table 2 cutoffs for a window of 512 bytes
+	static const int tableEntropy[] = { 8000, 4000, 2000, 1000, 500 };
+	static const uint16_t tableCutoff[] = { 13, 62, 177, 311, 410 };
+	int entropy;
+	int i;
+
+	if (entropyPerMille < 1) {
+		entropyPerMille = 1;
+	} else if (entropyPerMille > 1000) {
+		entropyPerMille = 1000;
+	}
+	entropy = entropyPerMille * 8;
+	rct->maxRepetitions = (uint16_t)(1 + (20000 + entropy - 1) / entropy);
+	apt->windowSize = TL_APT_RAW_WINDOW_SIZE;
+	apt->cutoffValue = TL_APT_RAW_WINDOW_SIZE;
+	for (i = 0; i < (int)(sizeof(tableEntropy) / sizeof(tableEntropy[0])); i++) {
+		if (entropy >= tableEntropy[i]) {
+			apt->cutoffValue = tableCutoff[i];
+			break;
+		}
+	}
+}
+
+/**
+ * Strip the FTDI status bytes from a bulk-in transfer. Every 'packetSize'
+ * bytes received start with TL_FTDI_STATUS_BYTES status bytes that are not
+ * part of the device data.
+ *
+ * @param const uint8_t *src - pointer to the bulk-in transfer
+ * @param int transferred - number of bytes in the bulk-in transfer
+ * @param int packetSize - the bulk-in endpoint max packet size
+ * @param uint8_t *dst - pointer to the data receive buffer
+ * @param int cnt - number of bytes already in the data receive buffer
+ * @param int length - how many bytes expected in the data receive buffer
+ * @return int number of bytes in the data receive buffer
+ *
+ */
+static inline int tl_ftdi_deframe(const uint8_t *src, int transferred, int packetSize, uint8_t *dst, int cnt, int length) {
+	int i;
+
+	if (transferred <= TL_FTDI_STATUS_BYTES) {
+		return cnt;
+	}
+	for (i = 0; i < transferred && cnt < length; i++) {
+		if ((i % packetSize) == 0) {
+			i += TL_FTDI_STATUS_BYTES - 1;
+			continue;
+		}
+		dst[cnt++] = src[i];
+	}
+	return cnt;
+}
+
+// Maximum number of trailing bytes kept after the conditioned data of a stream
+#define TL_COND_STREAM_TAIL_BYTES (4)
+
+// State of a conditioning stream, raw bytes are staged in the 'srcToHash' block of 'sd' and
+// conditioned as soon as a block is complete, without an intermediate raw buffer
+struct tl_cond_stream {
+	struct tl_sha256_data *sd;
+	struct tl_hmac_sha256 *hm;
+	uint32_t *dst;
+	int blockWords;
+	int dataBytes;
+	int blockFill;
+	int outWords;
+	uint32_t startSerialNumber;
+	bool startIsSeeded;
+	// Health tests of the raw bytes, NULL when only the output is tested
+	struct tl_rct_data *rawRct;
+	struct tl_apt_data *rawApt;
+	uint8_t tail[TL_COND_STREAM_TAIL_BYTES];
+	int tailBytes;
+};
+
+/**
+ * Start a conditioning stream. The first 'dataBytes' bytes fed into it are conditioned, the
+ * bytes that follow are kept in 'tail'.
+ *
+ * @param struct tl_cond_stream *cs - pointer to the stream
+ * @param struct tl_sha256_data *sd - pointer to the SHA-256 data
+ * @param struct tl_hmac_sha256 *hm - the HMAC key state, NULL for plain SHA-256
+ * @param int blockWords - number of input words hashed into one output block
+ * @param int dataBytes - number of bytes to condition, a multiple of the block size
+ * @param uint32_t *dst - pointer to the destination words
+ *
+ */
+static inline void tl_cond_streamStart(struct tl_cond_stream *cs, struct tl_sha256_data *sd, struct tl_hmac_sha256 *hm, int blockWords, int dataBytes, uint32_t *dst) {
+	cs->sd = sd;
+	cs->hm = hm;
+	cs->dst = dst;
+	cs->blockWords = blockWords;
+	cs->dataBytes = dataBytes;
+	cs->blockFill = 0;
+	cs->outWords = 0;
+	cs->startSerialNumber = sd->blockSerialNumber;
+	cs->startIsSeeded = sd->isSeeded;
+	cs->rawRct = NULL;
+	cs->rawApt = NULL;
+	cs->tailBytes = 0;
+}
+
+/**
+ * Run the health tests on the raw bytes of a stream before they are conditioned. Hashing hides a
+ * stuck-at noise source from the tests of the output, the nonce changes every block.
+ *
+ * @param struct tl_cond_stream *cs - pointer to the started stream
+ * @param struct tl_rct_data *rct - pointer to the Repetition Count Test data for the raw bytes
+ * @param struct tl_apt_data *apt - pointer to the Adaptive Proportion Test data for the raw bytes
+ *
+ */
+static inline void tl_cond_streamTestRaw(struct tl_cond_stream *cs, struct tl_rct_data *rct, struct tl_apt_data *apt) {
+	cs->rawRct = rct;
+	cs->rawApt = apt;
+}
+
+/**
+ * Discard what was fed into a stream so far, the serial numbers used by it are given back and a boot
+ * seed taken from it is dropped
+ *
+ * @param struct tl_cond_stream *cs - pointer to the stream
+ *
+ */
+static inline void tl_cond_streamRestart(struct tl_cond_stream *cs) {
+	cs->sd->blockSerialNumber = cs->startSerialNumber;
+	if (!cs->startIsSeeded) {
+		cs->sd->bootSeed = 0;
+		cs->sd->isSeeded = false;
+	}
+	cs->blockFill = 0;
+	cs->outWords = 0;
+	cs->tailBytes = 0;
+}
+
+/**
+ * Feed raw bytes into a conditioning stream. The output is identical to tl_cond_conditionWords()
+ * over the same bytes.
+ *
+ * @param struct tl_cond_stream *cs - pointer to the stream
+ * @param const uint8_t *src - pointer to the raw bytes
+ * @param int len - number of raw bytes
+ *
+ */
+static inline void tl_cond_streamFeed(struct tl_cond_stream *cs, const uint8_t *src, int len) {
+	struct tl_sha256_data *sd = cs->sd;
+	int blockBytes = cs->blockWords * 4;
+	int fed = cs->outWords / TL_SHA256_OUT_WORDS * blockBytes + cs->blockFill;
+	int n;
+
+	while (len > 0 && fed < cs->dataBytes) {
+		n = blockBytes - cs->blockFill;
+		if (n > len) {
+			n = len;
+		}
+		if (cs->rawRct != NULL) {
+			tl_health_sampleBuffer(cs->rawRct, cs->rawApt, src, n);
+		}
+		memcpy((uint8_t *)sd->srcToHash + cs->blockFill, src, n);
+		cs->blockFill += n;
+		fed += n;
+		src += n;
+		len -= n;
+		if (cs->blockFill == blockBytes) {
+			tl_cond_hashBlock(sd, cs->hm, cs->blockWords, cs->dst + cs->outWords);
+			cs->outWords += TL_SHA256_OUT_WORDS;
+			cs->blockFill = 0;
+		}
+	}
+	while (len > 0 && cs->tailBytes < TL_COND_STREAM_TAIL_BYTES) {
+		cs->tail[cs->tailBytes++] = *src++;
+		len--;
+	}
+}
+
+/**
+ * Strip the FTDI status bytes from a bulk-in transfer and feed the data into a conditioning stream
+ *
+ * @param const uint8_t *src - pointer to the bulk-in transfer
+ * @param int transferred - number of bytes in the bulk-in transfer
+ * @param int packetSize - the bulk-in endpoint max packet size
+ * @param struct tl_cond_stream *cs - pointer to the stream
+ * @param int cnt - number of bytes already fed into the stream
+ * @param int length - how many bytes expected in total
+ * @return int number of bytes fed into the stream
+ *
+ */
+static inline int tl_ftdi_deframeToStream(const uint8_t *src, int transferred, int packetSize, struct tl_cond_stream *cs, int cnt, int length) {
+	int i;
+	int n;
+
+	for (i = 0; i < transferred && cnt < length; i += packetSize) {
+		n = transferred - i;
+		if (n > packetSize) {
+			n = packetSize;
+		}
+		n -= TL_FTDI_STATUS_BYTES;
+		if (n <= 0) {
+			continue;
+		}
+		if (n > length - cnt) {
+			n = length - cnt;
+		}
+		tl_cond_streamFeed(cs, src + i + TL_FTDI_STATUS_BYTES, n);
+		cnt += n;
+	}
+	return cnt;
+}
+
+// Output buffer reservoir word, claimed by lock-free readers with one compare and swap. Bits 0-24 hold
+// the next unclaimed byte, bits 25-49 the end of the conditioned bytes and bits 50-63 a generation that
+// is odd while the lock holder owns the buffer.
+#define TL_RESERVOIR_IDX_BITS (25)
+#define TL_RESERVOIR_IDX_MASK ((1ULL << TL_RESERVOIR_IDX_BITS) - 1)
+#define TL_RESERVOIR_GEN_SHIFT (2 * TL_RESERVOIR_IDX_BITS)
+#define tl_reservoir_idx(w) ((int)((uint64_t)(w) & TL_RESERVOIR_IDX_MASK))
+#define tl_reservoir_end(w) ((int)(((uint64_t)(w) >> TL_RESERVOIR_IDX_BITS) & TL_RESERVOIR_IDX_MASK))
+#define tl_reservoir_gen(w) ((uint64_t)(w) >> TL_RESERVOIR_GEN_SHIFT)
+#define tl_reservoir_word(gen, idx, end) ((int64_t)(((uint64_t)(gen) << TL_RESERVOIR_GEN_SHIFT) | ((uint64_t)(end) << TL_RESERVOIR_IDX_BITS) | (uint64_t)(idx)))
+
+#endif /* TLCOND_H_ */
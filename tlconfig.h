@@ -0,0 +1,95 @@
+/*
+ * tlconfig.h
+ * ver. 2.3
+ *
+ */
+
+/*
+ * TL100/TL200 device driver build options - 2.3
+ *
+ * Copyright (C) 2014-2016 TectroLabs, http://tectrolabs.com
+ *
+ * The optional parts of the 'tlrandom' kernel module are selected when it is
+ * built, with CONFIG_TLRANDOM_* symbols defined the way Kconfig defines them:
+ * make ccflags-y="-DCONFIG_TLRANDOM_PROFILE_MINIMAL"
+ *
+ * A disabled feature is not compiled in and its module parameters do not
+ * exist, the code paths that used it test a constant instead of a variable.
+ *
+ * Profiles:
+ *   CONFIG_TLRANDOM_PROFILE_SERVER - all the features (the default)
+ *   CONFIG_TLRANDOM_PROFILE_MINIMAL - none of the features, with the output
+ *     buffer size and the conditioning profile fixed at build time
+ *   CONFIG_TLRANDOM_PROFILE_CUSTOM - only the features defined on the command line
+ *
+ * Features, any of them can be added to the minimal profile:
+ *   CONFIG_TLRANDOM_STATS - the debugfs 'stats' file
+ *   CONFIG_TLRANDOM_TRAFFIC - USB traffic record and replay
+ *   CONFIG_TLRANDOM_QOS - service classes and rate limits of the open files
+ *   CONFIG_TLRANDOM_EXPRESS - the express pool for short reads
+ *   CONFIG_TLRANDOM_COND_HMAC - the HMAC-SHA256 conditioning profile
+ *   CONFIG_TLRANDOM_AUDIT - the 'audit_mode' check that no output byte is
+ *     handed out twice, off until the module parameter turns it on
+ *
+ * Build time values:
+ *   CONFIG_TLRANDOM_OUT_BUFFER_BYTES=n - fixed output buffer size, replaces
+ *     the 'out_buffer_bytes' module parameter
+ *   CONFIG_TLRANDOM_COND_PROFILE=n - fixed conditioning profile, replaces
+ *     the 'cond_profile' module parameter
+ *   CONFIG_TLRANDOM_FAIL_THRESHOLD=n - health test failure threshold,
+ *     'numConsecFailThreshold' when not given
+ *
+ */
+
+#ifndef TLCONFIG_H_
+#define TLCONFIG_H_
+
+#if defined(CONFIG_TLRANDOM_PROFILE_MINIMAL) + defined(CONFIG_TLRANDOM_PROFILE_SERVER) + defined(CONFIG_TLRANDOM_PROFILE_CUSTOM) > 1
+#error "Only one CONFIG_TLRANDOM_PROFILE_* can be selected"
+#endif
+
+#if defined(CONFIG_TLRANDOM_PROFILE_MINIMAL)
+
+#ifndef CONFIG_TLRANDOM_OUT_BUFFER_BYTES
+#define CONFIG_TLRANDOM_OUT_BUFFER_BYTES TRND_OUT_BUFFSIZE
+#endif
+#ifndef CONFIG_TLRANDOM_COND_PROFILE
+#define CONFIG_TLRANDOM_COND_PROFILE 1
+#endif
+
+#elif !defined(CONFIG_TLRANDOM_PROFILE_CUSTOM)
+
+#ifndef CONFIG_TLRANDOM_PROFILE_SERVER
+#define CONFIG_TLRANDOM_PROFILE_SERVER 1
+#endif
+#ifndef CONFIG_TLRANDOM_STATS
+#define CONFIG_TLRANDOM_STATS 1
+#endif
+#ifndef CONFIG_TLRANDOM_TRAFFIC
+#define CONFIG_TLRANDOM_TRAFFIC 1
+#endif
+#ifndef CONFIG_TLRANDOM_QOS
+#define CONFIG_TLRANDOM_QOS 1
+#endif
+#ifndef CONFIG_TLRANDOM_EXPRESS
+#define CONFIG_TLRANDOM_EXPRESS 1
+#endif
+#ifndef CONFIG_TLRANDOM_COND_HMAC
+#define CONFIG_TLRANDOM_COND_HMAC 1
+#endif
+#ifndef CONFIG_TLRANDOM_AUDIT
+#define CONFIG_TLRANDOM_AUDIT 1
+#endif
+
+#endif
+
+#ifdef CONFIG_TLRANDOM_FAIL_THRESHOLD
+#define TLRANDOM_FAIL_THRESHOLD (CONFIG_TLRANDOM_FAIL_THRESHOLD)
+#else
+#define TLRANDOM_FAIL_THRESHOLD (numConsecFailThreshold)
+#endif
+
+// The health tests in tlcond.h compare against the constant instead of their state
+#define TL_HEALTH_FAIL_THRESHOLD TLRANDOM_FAIL_THRESHOLD
+
+#endif /* TLCONFIG_H_ */
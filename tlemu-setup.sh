@@ -0,0 +1,97 @@
+#!/bin/sh
+#
+# tlemu-setup.sh
+# ver. 2.3
+#
+# Creates an emulated TL200 device on the 'dummy_hcd' virtual USB controller
+# and starts the 'tlemu' emulator for it (see tlemu.c).
+#
+# Usage:
+#   sudo ./tlemu-setup.sh start [tlemu options]  - create the gadget, start the emulator and plug it in
+#   sudo ./tlemu-setup.sh unplug                 - disconnect the emulated device from the host
+#   sudo ./tlemu-setup.sh plug                   - connect the emulated device to the host again
+#   sudo ./tlemu-setup.sh stop                   - stop the emulator and remove the gadget
+#
+# The vendor and product IDs must match the ones the 'tlrandom' module is
+# looking for, override them with TLEMU_VID and TLEMU_PID when needed.
+# Make sure the 'ftdi_sio' module does not claim the emulated device before
+# 'tlrandom' does.
+#
+
+GADGET=/sys/kernel/config/usb_gadget/tlemu
+FFS_DIR=/dev/ffs-tlemu
+PID_FILE=/var/run/tlemu.pid
+VID=${TLEMU_VID:-0x0403}
+PID=${TLEMU_PID:-0x6014}
+EMU=${TLEMU_BIN:-$(dirname "$0")/tlemu}
+
+find_udc() {
+	ls /sys/class/udc | grep dummy_udc | head -n 1
+}
+
+start() {
+	modprobe libcomposite || exit 1
+	modprobe dummy_hcd || exit 1
+	mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+	mkdir -p $GADGET || exit 1
+	echo $VID > $GADGET/idVendor
+	echo $PID > $GADGET/idProduct
+	mkdir -p $GADGET/strings/0x409
+	echo "TectroLabs" > $GADGET/strings/0x409/manufacturer
+	echo "TL200 emulator" > $GADGET/strings/0x409/product
+	echo "TLEMU0001" > $GADGET/strings/0x409/serialnumber
+	mkdir -p $GADGET/configs/c.1/strings/0x409
+	echo "TL200" > $GADGET/configs/c.1/strings/0x409/configuration
+	echo 100 > $GADGET/configs/c.1/MaxPower
+	mkdir -p $GADGET/functions/ffs.tlemu
+	[ -e $GADGET/configs/c.1/ffs.tlemu ] || ln -s $GADGET/functions/ffs.tlemu $GADGET/configs/c.1/
+
+	mkdir -p $FFS_DIR
+	mountpoint -q $FFS_DIR || mount -t functionfs tlemu $FFS_DIR || exit 1
+
+	"$EMU" -d $FFS_DIR "$@" &
+	echo $! > $PID_FILE
+
+	# The endpoint files show up once the emulator has written its descriptors
+	for i in $(seq 50); do
+		[ -e $FFS_DIR/ep2 ] && break
+		sleep 0.1
+	done
+	if [ ! -e $FFS_DIR/ep2 ]; then
+		echo "The emulator did not start"
+		exit 1
+	fi
+	plug
+}
+
+plug() {
+	find_udc > $GADGET/UDC
+}
+
+unplug() {
+	echo "" > $GADGET/UDC 2>/dev/null
+}
+
+stop() {
+	unplug
+	if [ -f $PID_FILE ]; then
+		kill $(cat $PID_FILE) 2>/dev/null
+		rm -f $PID_FILE
+		sleep 0.5
+	fi
+	mountpoint -q $FFS_DIR && umount $FFS_DIR
+	rm -f $GADGET/configs/c.1/ffs.tlemu
+	rmdir $GADGET/configs/c.1/strings/0x409 $GADGET/configs/c.1 2>/dev/null
+	rmdir $GADGET/functions/ffs.tlemu $GADGET/strings/0x409 $GADGET 2>/dev/null
+}
+
+cmd=$1
+[ $# -gt 0 ] && shift
+case "$cmd" in
+	start) start "$@" ;;
+	stop) stop ;;
+	plug) plug ;;
+	unplug) unplug ;;
+	*) echo "Usage: $0 start [tlemu options] | stop | plug | unplug"; exit 1 ;;
+esac
@@ -0,0 +1,615 @@
+/*
+ * tlemu.c
+ * ver. 2.3
+ *
+ */
+
+/*
+ * TL100/TL200 device emulator - 2.3
+ *
+ * Copyright (C) 2014-2016 TectroLabs, http://tectrolabs.com
+ *
+ * This is a user space program that emulates a TL100 or TL200 device as a
+ * USB gadget function (FunctionFS). Together with the 'dummy_hcd' kernel
+ * module it lets the 'tlrandom' kernel module run against an emulated
+ * device on any machine, for benchmarking and soak testing the USB path,
+ * hotplug and health test handling without hardware.
+ *
+ * The emulator speaks the same protocol as the device:
+ *   'x' <low byte count> <high byte count> - send the requested number of
+ *        random bytes followed by one status byte (0 for success)
+ *   'm' - send the device model followed by one status byte
+ * Every bulk-in packet starts with the two FTDI modem status bytes, the
+ * same way the FTDI chip on the device frames its data.
+ *
+ * Use the tlemu-setup.sh script to create the gadget and start the
+ * emulator:
+ * sudo ./tlemu-setup.sh start [tlemu options]
+ *
+ * Build it with:
+ * cc -O2 -pthread -o tlemu tlemu.c
+ *
+ * Options:
+ *   -d <dir>     FunctionFS mount directory (required)
+ *   -p <bytes>   bulk-in max packet size, 512 for high speed and 64 for full speed (default 512)
+ *   -m <model>   device model, TL200 or TL100 (default TL200)
+ *   -r <bytes>   maximum data rate in random bytes per second, 0 for unlimited (default 0)
+ *   -l <msecs>   latency between receiving a command and sending the first data packet (default 0)
+ *   -e <ppm>     probability of a faulty response in parts per million (default 0)
+ *   -k <byte>    send a stuck-at byte value instead of random data
+ *   -a <count>   number of good responses before the stuck-at fault starts (default 0)
+ *   -s <seed>    seed for the random data generator (default time based)
+ *
+ * Faulty responses are chosen at random between a non-zero status byte,
+ * a truncated response and a dropped response. Send SIGUSR1 to print the
+ * statistics, they are also printed on exit.
+ *
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#define SUCCESS (0)
+
+// Constant byte order conversions usable in static initializers
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x) (x)
+#define cpu_to_le32(x) (x)
+#else
+#define cpu_to_le16(x) ((((x) >> 8) & 0xffu) | (((x) & 0xffu) << 8))
+#define cpu_to_le32(x) ((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8) | \
+		(((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
+#endif
+
+// Vendor specific interface, same as the FTDI chip
+#define EMU_INTERFACE_CLASS (0xff)
+
+// FTDI modem status bytes sent in front of every bulk-in packet
+#define EMU_MODEM_STATUS_0 (0x31)
+#define EMU_MODEM_STATUS_1 (0x60)
+
+// Length of the model string returned by the 'm' command
+#define EMU_MODEL_LENGTH (6)
+
+// How many bulk-in packets to send in one write
+#define EMU_PACKETS_PER_WRITE (32)
+
+enum emu_fault {
+	FAULT_NONE,
+	FAULT_BAD_STATUS,
+	FAULT_TRUNCATE,
+	FAULT_DROP,
+	NUM_FAULTS
+};
+
+static const struct {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct {
+		struct usb_interface_descriptor intf;
+		struct usb_endpoint_descriptor_no_audio bulkIn;
+		struct usb_endpoint_descriptor_no_audio bulkOut;
+	} __attribute__((packed)) fs_descs, hs_descs;
+} __attribute__((packed)) descriptors = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC),
+		.length = cpu_to_le32(sizeof(descriptors)),
+	},
+	.fs_count = cpu_to_le32(3),
+	.hs_count = cpu_to_le32(3),
+	.fs_descs = {
+		.intf = {
+			.bLength = sizeof(descriptors.fs_descs.intf),
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bNumEndpoints = 2,
+			.bInterfaceClass = EMU_INTERFACE_CLASS,
+			.iInterface = 1,
+		},
+		.bulkIn = {
+			.bLength = sizeof(descriptors.fs_descs.bulkIn),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 1 | USB_DIR_IN,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = cpu_to_le16(64),
+		},
+		.bulkOut = {
+			.bLength = sizeof(descriptors.fs_descs.bulkOut),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 2 | USB_DIR_OUT,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = cpu_to_le16(64),
+		},
+	},
+	.hs_descs = {
+		.intf = {
+			.bLength = sizeof(descriptors.hs_descs.intf),
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bNumEndpoints = 2,
+			.bInterfaceClass = EMU_INTERFACE_CLASS,
+			.iInterface = 1,
+		},
+		.bulkIn = {
+			.bLength = sizeof(descriptors.hs_descs.bulkIn),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 1 | USB_DIR_IN,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = cpu_to_le16(512),
+		},
+		.bulkOut = {
+			.bLength = sizeof(descriptors.hs_descs.bulkOut),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 2 | USB_DIR_OUT,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = cpu_to_le16(512),
+		},
+	},
+};
+
+#define EMU_STRING "TL200 emulator"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		const char str1[sizeof(EMU_STRING)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = cpu_to_le32(sizeof(strings)),
+		.str_count = cpu_to_le32(1),
+		.lang_count = cpu_to_le32(1),
+	},
+	.lang0 = {
+		cpu_to_le16(0x0409),
+		EMU_STRING,
+	},
+};
+
+// Emulator settings
+static const char *ffsDir;
+static int packetSize = 512;
+static char model[EMU_MODEL_LENGTH + 1] = "TL200 ";
+static long maxRate;
+static long latencyMsecs;
+static long faultPpm;
+static int stuckAtValue = -1;
+static unsigned long stuckAfterCnt;
+static uint64_t rngState;
+
+// Emulator statistics
+static volatile unsigned long statCommands;
+static volatile unsigned long statResponses;
+static volatile unsigned long long statBytes;
+static volatile unsigned long statFaults[NUM_FAULTS];
+static volatile unsigned long statUnknownCommands;
+static volatile unsigned long statDisconnects;
+static volatile sig_atomic_t printStats;
+static volatile sig_atomic_t isShutDown;
+static struct timespec startTime;
+
+static int ep0Fd = -1;
+static int bulkInFd = -1;
+static int bulkOutFd = -1;
+
+/**
+ * Get the next pseudo random number (xorshift64*)
+ *
+ * @return uint64_t - the next pseudo random number
+ *
+ */
+static uint64_t next_random(void) {
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 2685821657736338717ULL;
+}
+
+/**
+ * Get the time elapsed since a start time
+ *
+ * @param const struct timespec *start - the start time
+ * @return double - elapsed seconds
+ *
+ */
+static double secs_since(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Print the emulator statistics
+ *
+ */
+static void print_stats(void) {
+	double secs = secs_since(&startTime);
+
+	fprintf(stderr, "commands: %lu, responses: %lu, unknown commands: %lu, disconnects: %lu\n",
+			statCommands, statResponses, statUnknownCommands, statDisconnects);
+	fprintf(stderr, "random bytes sent: %llu, average rate: %.0f bytes/sec\n",
+			statBytes, secs > 0 ? statBytes / secs : 0);
+	fprintf(stderr, "faults injected: bad status %lu, truncated %lu, dropped %lu\n",
+			statFaults[FAULT_BAD_STATUS], statFaults[FAULT_TRUNCATE], statFaults[FAULT_DROP]);
+}
+
+static void handle_signal(int sig) {
+	if (sig == SIGUSR1) {
+		printStats = 1;
+	} else {
+		isShutDown = 1;
+	}
+}
+
+/**
+ * Sleep for a number of microseconds
+ *
+ * @param long usecs - microseconds to sleep
+ *
+ */
+static void sleep_usecs(long usecs) {
+	struct timespec ts;
+
+	if (usecs <= 0) {
+		return;
+	}
+	ts.tv_sec = usecs / 1000000;
+	ts.tv_nsec = (usecs % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR && !isShutDown) {
+	}
+}
+
+/**
+ * Write the whole buffer to the bulk-in endpoint
+ *
+ * @param const uint8_t *buff - pointer to the data
+ * @param size_t length - number of bytes to write
+ * @return int - 0 for successful operation, otherwise -1
+ *
+ */
+static int write_bulk_in(const uint8_t *buff, size_t length) {
+	ssize_t written;
+
+	while (length > 0) {
+		written = write(bulkInFd, buff, length);
+		if (written < 0) {
+			if (errno == EINTR && !isShutDown) {
+				continue;
+			}
+			return -1;
+		}
+		buff += written;
+		length -= written;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Send a response payload framed into bulk-in packets. The last byte of
+ * the payload is the device status byte.
+ *
+ * @param const uint8_t *payload - pointer to the payload, NULL to generate random data
+ * @param int length - number of payload bytes, including the status byte
+ * @param uint8_t status - the status byte sent at the end of the payload
+ * @return int - 0 for successful operation, otherwise -1
+ *
+ */
+static int send_response(const uint8_t *payload, int length, uint8_t status) {
+	static uint8_t *frame;
+	int dataPerPacket = packetSize - 2;
+	int sent = 0;
+	int cnt;
+	int i;
+	uint64_t rnd = 0;
+	struct timespec rateStart;
+	double expectedSecs;
+
+	if (frame == NULL) {
+		frame = malloc((size_t)packetSize * EMU_PACKETS_PER_WRITE);
+		if (frame == NULL) {
+			return -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &rateStart);
+	while (sent < length) {
+		cnt = 0;
+		while (sent < length && cnt < packetSize * EMU_PACKETS_PER_WRITE) {
+			frame[cnt++] = EMU_MODEM_STATUS_0;
+			frame[cnt++] = EMU_MODEM_STATUS_1;
+			for (i = 0; i < dataPerPacket && sent < length; i++, sent++) {
+				if (sent == length - 1) {
+					frame[cnt++] = status;
+				} else if (payload != NULL) {
+					frame[cnt++] = payload[sent];
+				} else if (stuckAtValue >= 0 && statResponses >= stuckAfterCnt) {
+					frame[cnt++] = (uint8_t)stuckAtValue;
+				} else {
+					if ((sent & 7) == 0) {
+						rnd = next_random();
+					}
+					frame[cnt++] = (uint8_t)rnd;
+					rnd >>= 8;
+				}
+			}
+		}
+		if (write_bulk_in(frame, cnt) != SUCCESS) {
+			return -1;
+		}
+		if (maxRate > 0) {
+			// Throttle to the configured data rate
+			expectedSecs = (double)sent / maxRate;
+			sleep_usecs((long)((expectedSecs - secs_since(&rateStart)) * 1e6));
+		}
+	}
+	return SUCCESS;
+}
+
+/**
+ * Pick a fault for the next response
+ *
+ * @return enum emu_fault - the fault to inject or FAULT_NONE
+ *
+ */
+static enum emu_fault pick_fault(void) {
+	if (faultPpm <= 0 || (long)(next_random() % 1000000) >= faultPpm) {
+		return FAULT_NONE;
+	}
+	return FAULT_BAD_STATUS + next_random() % (NUM_FAULTS - FAULT_BAD_STATUS);
+}
+
+/**
+ * Handle a command received from the host
+ *
+ * @param const uint8_t *cmd - pointer to the command bytes
+ * @param int length - number of command bytes received
+ * @return int - number of command bytes consumed, or -1 on a transfer error
+ *
+ */
+static int handle_command(const uint8_t *cmd, int length) {
+	int byteCnt;
+	int payloadLength;
+	uint8_t status = 0;
+	enum emu_fault fault;
+
+	switch (cmd[0]) {
+	case 'x':
+		if (length < 3) {
+			// Wait for the rest of the command
+			return 0;
+		}
+		byteCnt = cmd[1] | (cmd[2] << 8);
+		payloadLength = byteCnt + 1;
+		statCommands++;
+		sleep_usecs(latencyMsecs * 1000);
+		fault = pick_fault();
+		statFaults[fault]++;
+		if (fault == FAULT_DROP) {
+			return 3;
+		} else if (fault == FAULT_TRUNCATE) {
+			payloadLength = 1 + next_random() % payloadLength;
+		} else if (fault == FAULT_BAD_STATUS) {
+			status = 1 + next_random() % 0xff;
+		}
+		if (send_response(NULL, payloadLength, status) != SUCCESS) {
+			return -1;
+		}
+		statResponses++;
+		statBytes += payloadLength - 1;
+		return 3;
+	case 'm':
+		statCommands++;
+		sleep_usecs(latencyMsecs * 1000);
+		if (send_response((const uint8_t *)model, EMU_MODEL_LENGTH + 1, 0) != SUCCESS) {
+			return -1;
+		}
+		statResponses++;
+		return 1;
+	default:
+		statUnknownCommands++;
+		return 1;
+	}
+}
+
+/**
+ * Handle the FunctionFS control endpoint events
+ *
+ * @param void *arg - not used
+ * @return void* - always NULL
+ *
+ */
+static void *ep0_thread(void *arg) {
+	struct usb_functionfs_event event;
+	ssize_t rd;
+	uint8_t dummy;
+
+	(void)arg;
+	while (!isShutDown) {
+		rd = read(ep0Fd, &event, sizeof(event));
+		if (rd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		switch (event.type) {
+		case FUNCTIONFS_ENABLE:
+			fprintf(stderr, "Host enabled the device\n");
+			break;
+		case FUNCTIONFS_DISABLE:
+			fprintf(stderr, "Host disabled the device\n");
+			statDisconnects++;
+			break;
+		case FUNCTIONFS_SETUP:
+			// The TL devices use no control requests, acknowledge and ignore them
+			if (event.u.setup.bRequestType & USB_DIR_IN) {
+				if (write(ep0Fd, NULL, 0) < 0) {
+					// Nothing to do, the host gets a stall
+				}
+			} else if (read(ep0Fd, &dummy, 0) < 0) {
+				// Nothing to do, the host gets a stall
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Open an endpoint file in the FunctionFS mount directory
+ *
+ * @param const char *name - the endpoint file name
+ * @param int flags - open flags
+ * @return int - the file descriptor, -1 on failure
+ *
+ */
+static int open_endpoint(const char *name, int flags) {
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", ffsDir, name);
+	fd = open(path, flags);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	}
+	return fd;
+}
+
+static void print_usage(const char *name) {
+	fprintf(stderr, "Usage: %s -d <functionfs dir> [-p packet size] [-m model] [-r bytes/sec] [-l msecs] "
+			"[-e ppm] [-k byte] [-a count] [-s seed]\n", name);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	pthread_t ep0Thread;
+	struct sigaction sa;
+	uint8_t cmd[512];
+	int cmdLength = 0;
+	int consumed;
+	ssize_t rd;
+
+	rngState = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+	while ((opt = getopt(argc, argv, "d:p:m:r:l:e:k:a:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			ffsDir = optarg;
+			break;
+		case 'p':
+			packetSize = atoi(optarg);
+			break;
+		case 'm':
+			snprintf(model, sizeof(model), "%-6.6s", optarg);
+			break;
+		case 'r':
+			maxRate = atol(optarg);
+			break;
+		case 'l':
+			latencyMsecs = atol(optarg);
+			break;
+		case 'e':
+			faultPpm = atol(optarg);
+			break;
+		case 'k':
+			stuckAtValue = (int)strtol(optarg, NULL, 0) & 0xff;
+			break;
+		case 'a':
+			stuckAfterCnt = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			rngState = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (ffsDir == NULL || packetSize <= 2) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if (rngState == 0) {
+		rngState = 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	ep0Fd = open_endpoint("ep0", O_RDWR);
+	if (ep0Fd < 0) {
+		return 1;
+	}
+	if (write(ep0Fd, &descriptors, sizeof(descriptors)) < 0) {
+		fprintf(stderr, "Could not write the USB descriptors: %s\n", strerror(errno));
+		return 1;
+	}
+	if (write(ep0Fd, &strings, sizeof(strings)) < 0) {
+		fprintf(stderr, "Could not write the USB strings: %s\n", strerror(errno));
+		return 1;
+	}
+	bulkInFd = open_endpoint("ep1", O_RDWR);
+	bulkOutFd = open_endpoint("ep2", O_RDWR);
+	if (bulkInFd < 0 || bulkOutFd < 0) {
+		return 1;
+	}
+	if (pthread_create(&ep0Thread, NULL, ep0_thread, NULL) != 0) {
+		fprintf(stderr, "Could not start the control endpoint thread\n");
+		return 1;
+	}
+
+	fprintf(stderr, "Emulating a %.5s device, %d byte packets\n", model, packetSize);
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	while (!isShutDown) {
+		if (printStats) {
+			printStats = 0;
+			print_stats();
+		}
+		rd = read(bulkOutFd, cmd + cmdLength, sizeof(cmd) - cmdLength);
+		if (rd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// The host disabled the function (unplug, reset), wait until it is enabled again
+			cmdLength = 0;
+			sleep_usecs(10000);
+			continue;
+		}
+		cmdLength += rd;
+		while (cmdLength > 0) {
+			consumed = handle_command(cmd, cmdLength);
+			if (consumed <= 0) {
+				if (consumed < 0) {
+					cmdLength = 0;
+				}
+				break;
+			}
+			memmove(cmd, cmd + consumed, cmdLength - consumed);
+			cmdLength -= consumed;
+		}
+	}
+
+	print_stats();
+	close(bulkInFd);
+	close(bulkOutFd);
+	close(ep0Fd);
+	return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * tlrandom_ioctl.h
+ * ver. 2.3
+ *
+ */
+
+/*
+ * TL100/TL200 device driver ioctl interface - 2.3
+ *
+ * Copyright (C) 2014-2016 TectroLabs, http://tectrolabs.com
+ *
+ * This header is shared by the 'tlrandom' kernel module and the user space
+ * programs that use it. All the structures have fixed size fields and the
+ * same layout on 32 and 64 bit systems, pointers are passed as __u64.
+ *
+ * TLRANDOM_IOC_FILL
+ *   Fill an array of buffers with random bytes in one call. 'iov' points to
+ *   'iovCnt' struct tlrandom_iovec entries (at most TLRANDOM_MAX_IOV).
+ *   On return 'filled' holds the number of bytes written, which is less
+ *   than requested only when the call was interrupted or the device went
+ *   away part way through. A rate limited class waits for its tokens.
+ *   'reserved' must be 0.
+ *
+ * TLRANDOM_IOC_GET_STATUS
+ *   Get the output buffer level, the device state and the health test state.
+ *
+ * TLRANDOM_IOC_GET_ENTROPY
+ *   Get the estimated entropy of the buffered output.
+ *
+ * TLRANDOM_IOC_REFILL
+ *   Replace the buffered output with freshly conditioned bytes from the
+ *   device. Returns the number of bytes now buffered. Only CAP_SYS_ADMIN may
+ *   refill, since it drops the output buffered for all the readers.
+ *
+ * TLRANDOM_IOC_GET_STATS
+ *   Get a consistent snapshot of the transfer and error counters.
+ *
+ * TLRANDOM_IOC_SET_QOS, TLRANDOM_IOC_GET_QOS
+ *   Set or get the service class of the open file. Readers of the critical
+ *   class are served before all others, bulk readers never take the output
+ *   buffer below the 'bulk_watermark_bytes' module parameter. Each class can
+ *   be rate limited with the 'qos_rate_bytes' module parameter. Only
+ *   CAP_SYS_ADMIN may select the critical class.
+ *
+ * Example:
+ *   struct tlrandom_iovec iov[2] = { { (uintptr_t)key1, 32 }, { (uintptr_t)key2, 32 } };
+ *   struct tlrandom_fill fill = { (uintptr_t)iov, 2 };
+ *   int fd = open("/dev/tlrandom", O_RDONLY);
+ *   ioctl(fd, TLRANDOM_IOC_FILL, &fill);
+ *
+ */
+
+#ifndef TLRANDOM_IOCTL_H_
+#define TLRANDOM_IOCTL_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define TLRANDOM_IOC_MAGIC (0xB6)
+
+// Maximum number of buffers filled by one TLRANDOM_IOC_FILL call
+#define TLRANDOM_MAX_IOV (1024)
+
+// Values of 'healthStatus'
+#define TLRANDOM_HEALTH_OK (0)
+#define TLRANDOM_HEALTH_RCT_FAILED (1)
+#define TLRANDOM_HEALTH_APT_FAILED (2)
+
+// Values of 'qosClass'
+#define TLRANDOM_QOS_CRITICAL (0)
+#define TLRANDOM_QOS_NORMAL (1)
+#define TLRANDOM_QOS_BULK (2)
+#define TLRANDOM_QOS_CLASSES (3)
+
+// One buffer to fill
+struct tlrandom_iovec {
+	__u64 base;
+	__u64 len;
+};
+
+// Argument of TLRANDOM_IOC_FILL
+struct tlrandom_fill {
+	__u64 iov;
+	__u32 iovCnt;
+	__u32 reserved;
+	__u64 filled;
+};
+
+// Argument of TLRANDOM_IOC_GET_STATUS
+struct tlrandom_status {
+	__u32 bufferedBytes;
+	__u32 bufferSize;
+	__u32 isDeviceReady;
+	__u32 isDeviceGone;
+	__u32 healthStatus;
+	__u32 rctFailures;
+	__u32 aptFailures;
+	__u32 failThreshold;
+};
+
+// Argument of TLRANDOM_IOC_GET_ENTROPY
+struct tlrandom_entropy {
+	__u64 bufferedBytes;
+	__u64 entropyBits;
+	__u32 entropyPerMille;
+	__u32 reserved;
+};
+
+// Argument of TLRANDOM_IOC_GET_STATS
+struct tlrandom_stats {
+	__u64 deliveredBytes;
+	__u64 refills;
+	__u64 prefetches;
+	__u64 retries;
+	__u64 haltClears;
+	__u64 resets;
+	__u64 suspends;
+	__u64 wakeUps;
+	__u64 wakeUsMax;
+	__u64 disconnects;
+	__u64 replugWaits;
+	__u32 lastXferBytes;
+	__u32 demandRate;
+};
+
+// Argument of TLRANDOM_IOC_SET_QOS and TLRANDOM_IOC_GET_QOS
+struct tlrandom_qos {
+	__u32 qosClass;
+	__u32 reserved;
+};
+
+#define TLRANDOM_IOC_FILL _IOWR(TLRANDOM_IOC_MAGIC, 1, struct tlrandom_fill)
+#define TLRANDOM_IOC_GET_STATUS _IOR(TLRANDOM_IOC_MAGIC, 2, struct tlrandom_status)
+#define TLRANDOM_IOC_GET_ENTROPY _IOR(TLRANDOM_IOC_MAGIC, 3, struct tlrandom_entropy)
+#define TLRANDOM_IOC_REFILL _IO(TLRANDOM_IOC_MAGIC, 4)
+#define TLRANDOM_IOC_GET_STATS _IOR(TLRANDOM_IOC_MAGIC, 5, struct tlrandom_stats)
+#define TLRANDOM_IOC_SET_QOS _IOW(TLRANDOM_IOC_MAGIC, 6, struct tlrandom_qos)
+#define TLRANDOM_IOC_GET_QOS _IOR(TLRANDOM_IOC_MAGIC, 7, struct tlrandom_qos)
+
+#endif /* TLRANDOM_IOCTL_H_ */
@@ -47,15 +47,684 @@
  *
  * Currently the 'tlrandom' module can only use one TL device at a time.
  *
+ * Conditioned bytes already in the output buffer are still served after the
+ * device is unplugged. Once they are used up, readers wait 'replug_wait_ms'
+ * for the device to come back before failing.
+ *
+ * The USB traffic of a session can be recorded and replayed later without a
+ * device, to compare the conditioning and buffering of different module
+ * versions on identical input:
+ * echo 1 > /sys/module/tlrandom/parameters/traffic_mode
+ * dd if=/dev/tlrandom of=/dev/null bs=1000 count=1000
+ * echo 0 > /sys/module/tlrandom/parameters/traffic_mode
+ * cat /sys/kernel/debug/tlrandom/traffic > session.bin
+ *
+ * To replay it at the original timing (2) or at maximum speed (3):
+ * cat session.bin > /sys/kernel/debug/tlrandom/traffic
+ * echo 3 > /sys/module/tlrandom/parameters/traffic_mode
+ * dd if=/dev/tlrandom of=/dev/null bs=1000 count=1000
+ * cat /sys/kernel/debug/tlrandom/traffic_status
+ *
+ * The replayed output is checked against the digests of the recorded output.
+ *
+ * The device is suspended after 'autosuspend_delay_ms' idle milliseconds and
+ * refilled in the background when it wakes up. Transfer sizes and wake-up
+ * latencies are shown in /sys/kernel/debug/tlrandom/stats.
+ *
+ * Besides read(), the device supports the ioctl requests described in
+ * tlrandom_ioctl.h for filling many buffers in one call, querying the buffer
+ * level, health test state, entropy estimate and counters, and forcing a
+ * refill.
+ *
+ * The conditioned output buffer can be resized without reloading the module:
+ * echo 1048576 > /sys/module/tlrandom/parameters/out_buffer_bytes
+ *
+ * Every open file has a service class, 'default_qos' or the one set with
+ * TLRANDOM_IOC_SET_QOS. Critical readers are served first, bulk readers
+ * leave 'bulk_watermark_bytes' in the output buffer for the others, and each
+ * class can be limited to a rate in bytes per second:
+ * echo 0,0,65536 > /sys/module/tlrandom/parameters/qos_rate_bytes
+ *
+ * Reads of up to 'express_max_bytes' are served from a small express pool
+ * that is topped up ahead of every refill, so they do not wait behind the
+ * transfers of large readers. Every NUMA node has a pool of its own, readers
+ * take the bytes from the pool of the node they run on.
+ *
+ * The output buffer and the background refills are placed on the NUMA node of
+ * the USB host controller, or on the node set with 'producer_node':
+ * echo 1 > /sys/module/tlrandom/parameters/producer_node
+ * The bytes that still cross between nodes are counted in the stats.
+ *
+ * The conditioning trades throughput for entropy with 'cond_profile':
+ * 0 hashes four times the output size with SHA-256 for full entropy, 1 keeps the
+ * built-in ratio and 2 uses HMAC-SHA256, a vetted conditioning function, on
+ * as many raw bits as it outputs. The entropy each profile declares for the
+ * given 'raw_entropy_per_mille' is shown in /sys/kernel/debug/tlrandom/stats.
+ *
+ * The audit mode checks that no output byte is handed out twice. It keeps
+ * anchors of the handed out bytes in bloom filters and counts the repeats it
+ * confirms within about the last 1 MB handed out in the stats, it is meant
+ * for staging runs under full load:
+ * echo 1 > /sys/module/tlrandom/parameters/audit_mode
+ *
+ * A device that is plugged in is tested before its output is used: the raw
+ * bytes of its first refill go through the health tests before they are
+ * conditioned and its output is dropped, then the output
+ * buffer is filled with 'startup_prefill_bytes'. Only then is the device
+ * announced ready and registered with the kernel hwrng framework, so the
+ * readers waiting for it at boot are all served from memory. The hwrng
+ * quality follows 'cond_profile' and 'raw_entropy_per_mille', the device is
+ * registered again when it changes and not at all while it is 0, as it is
+ * while USB traffic is recorded or replayed.
+ *
+ * The model of the device is read when it is plugged in and picks the defaults
+ * of 'max_inflight', 'min_xfer_bytes' and 'max_xfer_bytes', the parameters are
+ * left at 0 to use them. The model, the firmware revision and the values in use
+ * are shown in the 'tlrandom' directory of the USB interface in sysfs:
+ * cat /sys/bus/usb/drivers/tlrandom/<interface>/tlrandom/model
+ *
+ * The optional features are selected when the module is built, see tlconfig.h.
+ * The minimal profile leaves them all out and fixes the output buffer size and
+ * the conditioning profile:
+ * make ccflags-y="-DCONFIG_TLRANDOM_PROFILE_MINIMAL"
+ *
  */
 
 #include "tlrandom.h"
+#include "tlconfig.h"
+#include "tlcond.h"
+#include "tlrandom_ioctl.h"
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/jump_label.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/hw_random.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Andrian Belinski");
 MODULE_DESCRIPTION("A module that registers a device for supplying true random bytes generated by Hardware RNG suchs as TL100 or TL200");
 MODULE_VERSION("2.3");
 
+// Post processing and health test data, the logic lives in tlcond.h
+static struct tl_sha256_data shaData;
+static struct tl_rct_data rctData;
+static struct tl_apt_data aptData;
+static struct tl_cond_stream condStream;
+// Health tests of the raw bytes of the startup test, before they are conditioned
+static struct tl_rct_data rawRctData;
+static struct tl_apt_data rawAptData;
+static bool isRawTestPending;
+
+// USB traffic record and replay modes
+#define TRAFFIC_OFF (0)
+#define TRAFFIC_RECORD (1)
+#define TRAFFIC_REPLAY_TIMED (2)
+#define TRAFFIC_REPLAY_FAST (3)
+
+// USB traffic record types
+#define TRAFFIC_REC_START (1)
+#define TRAFFIC_REC_CMD (2)
+#define TRAFFIC_REC_BULK_IN (3)
+#define TRAFFIC_REC_OUTPUT (4)
+
+#define TRAFFIC_MAGIC (0x52544c54)
+#define TRAFFIC_VERSION (3)
+
+// Header of every record in a USB traffic recording, followed by 'length' bytes of payload
+struct traffic_rec {
+	uint8_t type;
+	uint8_t reserved[3];
+	int32_t status;
+	uint32_t length;
+	uint64_t timestampNs;
+} __attribute__((packed));
+
+// Payload of the TRAFFIC_REC_START record
+struct traffic_start {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t blockSerialNumber;
+	uint32_t bulkInSize;
+	uint32_t condProfile;
+	uint32_t deviceId;
+	uint32_t bootSeed;
+	uint32_t sliceId;
+	uint32_t isSeeded;
+} __attribute__((packed));
+
+static int trafficMode = TRAFFIC_OFF;
+// The live conditioner state, put aside while a recording is replayed
+static struct traffic_start liveState;
+static int trafficBuffKb = 16384;
+
+#ifdef CONFIG_TLRANDOM_TRAFFIC
+static int set_traffic_mode(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops trafficModeOps = {
+	.set = set_traffic_mode,
+	.get = param_get_int,
+};
+
+module_param_cb(traffic_mode, &trafficModeOps, &trafficMode, 0644);
+MODULE_PARM_DESC(traffic_mode, "USB traffic: 0 - pass through, 1 - record, 2 - replay at original timing, 3 - replay at maximum speed");
+
+module_param_named(traffic_buffer_kb, trafficBuffKb, int, 0444);
+MODULE_PARM_DESC(traffic_buffer_kb, "Size of the USB traffic recording buffer in KB");
+#endif
+
+static uint8_t *trafficBuff;
+static size_t trafficLen;
+static size_t trafficPos;
+static bool isTrafficStartPending;
+static bool isTrafficSkipped;
+static bool isTrafficRdy;
+static uint64_t trafficFirstNs;
+static uint64_t replayStartNs;
+static uint32_t replayBulkInSize;
+static char replayCmdBuff[4];
+static unsigned long trafficDropped;
+static unsigned long replayOutputMatches;
+static unsigned long replayOutputMismatches;
+static unsigned long replayCmdMismatches;
+static struct dentry *debugDir;
+
+// Upper limit for the 'max_inflight' module parameter
+#define MAX_INFLIGHT_URBS (8)
+
+// Limits for discarding the rest of an aborted response
+#define DRAIN_MAX_TRANSFERS (16)
+#define DRAIN_WAIT_MSECS (50)
+
+// How often the consumer demand rate is sampled
+#define DEMAND_SAMPLE_MSECS (100)
+
+// A bulk-in URB with its transfer buffer
+struct bulk_in_req {
+	struct urb *urb;
+	uint8_t *buffer;
+	struct completion done;
+};
+
+// Device state kept along with struct usb_data, 'usbData' points to the 'usb' member.
+// The USB binding holds one reference, every refill holds another one.
+struct tl_device {
+	struct usb_data usb;
+	struct kref kref;
+	bool isDisconnected;
+	bool isResetting;
+	bool needsDrain;
+	struct usb_anchor urbAnchor;
+	struct urb *cmdUrb;
+	struct completion cmdDone;
+	struct bulk_in_req bulkIn[MAX_INFLIGHT_URBS];
+	int numBulkIn;
+};
+
+static struct tl_device *tlDev;
+
+// Readers and background refills in progress, biased by one until the module is unloaded
+static atomic_t pendingOps = ATOMIC_INIT(1);
+static DECLARE_COMPLETION(pendingOpsDone);
+
+static int maxInflight;
+module_param_named(max_inflight, maxInflight, int, 0444);
+MODULE_PARM_DESC(max_inflight, "Maximum number of bulk-in transfers in flight, 1 to 8, 0 uses the default of the device model");
+
+static int minXferBytes;
+module_param_named(min_xfer_bytes, minXferBytes, int, 0644);
+MODULE_PARM_DESC(min_xfer_bytes, "Smallest number of raw bytes requested from the device in one refill, 0 uses the default of the device model");
+
+static int maxXferBytes;
+module_param_named(max_xfer_bytes, maxXferBytes, int, 0644);
+MODULE_PARM_DESC(max_xfer_bytes, "Largest number of raw bytes requested from the device in one command, 0 uses the default of the device model");
+
+// Length of the model name returned by the 'm' command, padded with spaces
+#define DEV_MODEL_BYTES (6)
+
+// Transfer defaults of a device model, used for the module parameters left at 0
+struct tl_model {
+	const char *name;
+	int inflight;
+	int minXferBytes;
+	int maxXferBytes;
+	int expectedRate;
+};
+
+#define TL_MODEL_UNKNOWN (0)
+
+static const struct tl_model tlModels[] = {
+	[TL_MODEL_UNKNOWN] = { "unknown", 4, 1024, RND_IN_BUFFSIZE, 0 },
+	{ "TL100", 4, 1024, RND_IN_BUFFSIZE, 400000 },
+	{ "TL200", 8, 4096, RND_IN_BUFFSIZE, 3500000 },
+};
+
+// Device information read at probe time, kept until the next device is probed
+struct tl_dev_info {
+	char model[DEV_MODEL_BYTES + 1];
+	char serial[64];
+	uint16_t firmware;
+	int maxPacket;
+	int speed;
+};
+
+static const struct tl_model *devModel = &tlModels[TL_MODEL_UNKNOWN];
+static struct tl_dev_info devInfo;
+
+static int demandWindowMsecs = 100;
+module_param_named(demand_window_ms, demandWindowMsecs, int, 0644);
+MODULE_PARM_DESC(demand_window_ms, "How many milliseconds of the measured consumer demand one command should cover");
+
+// Limits for the 'out_buffer_bytes' module parameter
+#define MIN_OUT_BUFFER_BYTES (OUT_NUM_WORDS * WORD_SIZE_BYTES)
+#define MAX_OUT_BUFFER_BYTES (16 * 1024 * 1024)
+
+#ifdef CONFIG_TLRANDOM_OUT_BUFFER_BYTES
+// Fixed when the module is built
+static const int outBufferBytes = CONFIG_TLRANDOM_OUT_BUFFER_BYTES;
+#else
+static int set_out_buffer_bytes(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops outBufferBytesOps = {
+	.set = set_out_buffer_bytes,
+	.get = param_get_int,
+};
+
+static int outBufferBytes = TRND_OUT_BUFFSIZE;
+module_param_cb(out_buffer_bytes, &outBufferBytesOps, &outBufferBytes, 0644);
+MODULE_PARM_DESC(out_buffer_bytes, "Size of the conditioned output buffer in bytes, can be changed while the module is loaded");
+#endif
+
+// Conditioning profiles, selected with the 'cond_profile' module parameter
+#define COND_PROFILE_FULL (0)
+#define COND_PROFILE_DEFAULT (1)
+#define COND_PROFILE_HMAC (2)
+
+struct cond_profile {
+	const char *name;
+	int blockWords;
+	bool isHmac;
+};
+
+// At the default 'raw_entropy_per_mille' of 500 the profiles declare 1000, 999 and 499 per mille.
+// The 4:1 profile keeps full entropy down to 313 per mille of raw entropy.
+static const struct cond_profile condProfiles[] = {
+	[COND_PROFILE_FULL] = { "sha256-4:1", 4 * OUT_NUM_WORDS, false },
+	[COND_PROFILE_DEFAULT] = { "sha256", MIN_INPUT_NUM_WORDS, false },
+#ifdef CONFIG_TLRANDOM_COND_HMAC
+	[COND_PROFILE_HMAC] = { "hmac-sha256-1:1", OUT_NUM_WORDS, true },
+#endif
+};
+
+#ifdef CONFIG_TLRANDOM_COND_PROFILE
+#if CONFIG_TLRANDOM_COND_PROFILE < COND_PROFILE_FULL || CONFIG_TLRANDOM_COND_PROFILE > COND_PROFILE_HMAC
+#error "CONFIG_TLRANDOM_COND_PROFILE is not a conditioning profile"
+#elif CONFIG_TLRANDOM_COND_PROFILE == COND_PROFILE_HMAC && !defined(CONFIG_TLRANDOM_COND_HMAC)
+#error "CONFIG_TLRANDOM_COND_PROFILE selects HMAC-SHA256 without CONFIG_TLRANDOM_COND_HMAC"
+#endif
+// Fixed when the module is built
+static const int condProfile = CONFIG_TLRANDOM_COND_PROFILE;
+#else
+static int set_cond_profile(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops condProfileOps = {
+	.set = set_cond_profile,
+	.get = param_get_int,
+};
+
+static int condProfile = COND_PROFILE_DEFAULT;
+module_param_cb(cond_profile, &condProfileOps, &condProfile, 0644);
+MODULE_PARM_DESC(cond_profile, "Conditioning: 0 - SHA-256 of four times the output size for full entropy, 1 - SHA-256 at the built-in ratio, 2 - HMAC-SHA256 of the output size");
+#endif
+
+static struct tl_hmac_sha256 hmacData;
+
+// Conditioning slice of the refills, the nonce counter is kept per slice
+#define COND_SLICE_MAIN (0)
+
+static int replugWaitMsecs = 2000;
+module_param_named(replug_wait_ms, replugWaitMsecs, int, 0644);
+MODULE_PARM_DESC(replug_wait_ms, "Milliseconds readers wait for an unplugged device to come back once the buffered output is used up");
+
+// The conditioned output outlives the device, these track an unplugged device
+static bool isDeviceGone;
+static ktime_t disconnectTime;
+static DECLARE_WAIT_QUEUE_HEAD(deviceWait);
+
+// Poll waiters, woken up when output becomes available or the device goes away
+static DECLARE_WAIT_QUEUE_HEAD(readWait);
+
+// Startup of a plugged in device, it is announced ready once the startup health test passed and
+// 'startup_prefill_bytes' of output are buffered
+#define STARTUP_TEST_BYTES (1024)
+
+static int startupPrefillBytes = 65536;
+module_param_named(startup_prefill_bytes, startupPrefillBytes, int, 0644);
+MODULE_PARM_DESC(startup_prefill_bytes, "Output bytes buffered after the startup health test before the device is announced ready");
+
+static int useHwrng = 1;
+module_param_named(hwrng, useHwrng, int, 0444);
+MODULE_PARM_DESC(hwrng, "Register the device with the kernel hwrng framework once it is ready and its output has entropy to credit: 0 - no, 1 - yes");
+
+static bool isStartupPending;
+static struct work_struct startupWork;
+static unsigned long startupFailCount;
+static ktime_t startupTime;
+static s64 startupMsecs;
+static bool isHwrngRegistered;
+static struct hwrng tlHwrng;
+// Serializes registering with the hwrng framework, taken before 'dataOpLock'
+static DEFINE_MUTEX(hwrngLock);
+static unsigned long disconnectCount;
+static unsigned long replugWaitCount;
+
+// NUMA node of the output buffer and whether it can be resized
+static int outBufferNode = NUMA_NO_NODE;
+
+static int set_producer_node(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops producerNodeOps = {
+	.set = set_producer_node,
+	.get = param_get_int,
+};
+
+static int producerNodeParam = NUMA_NO_NODE;
+module_param_cb(producer_node, &producerNodeOps, &producerNodeParam, 0644);
+MODULE_PARM_DESC(producer_node, "NUMA node of the output buffer and the background refills, -1 follows the USB host controller");
+
+// NUMA node of the USB host controller of the last device plugged in
+static int usbNode = NUMA_NO_NODE;
+static atomic_long_t crossNodeReadBytes = ATOMIC_LONG_INIT(0);
+static unsigned long crossNodeRefills;
+static unsigned long crossNodeFillBytes;
+static bool isOutBufferRdy;
+
+// Number of conditioned bytes available in buffTRndOut
+static int trngOutLen;
+
+// Lock-free view of the output buffer for readers claiming bytes without 'dataOpLock', packed as
+// described in tlcond.h. The generation is odd while the lock holder owns 'curTrngOutIdx' and
+// 'trngOutLen' to refill or move the bytes.
+static atomic64_t outReservoir = ATOMIC64_INIT(0);
+static atomic64_t lockFreeDelivered[TLRANDOM_QOS_CLASSES];
+static atomic_long_t lockFreeDemandBytes = ATOMIC_LONG_INIT(0);
+
+// Consumer demand, used for sizing the device commands
+static atomic_t readersQueued = ATOMIC_INIT(0);
+// Readers copying a claimed range of the output buffer without holding 'dataOpLock'
+static atomic_t copiesInFlight = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(copiesDone);
+static size_t readPending;
+static unsigned long demandRate;
+static unsigned long avgReadSize;
+static unsigned long demandSampleBytes;
+static ktime_t demandSampleStart;
+static int lastXferBytes;
+
+static int readTimeoutMsecs;
+module_param_named(read_timeout_ms, readTimeoutMsecs, int, 0644);
+MODULE_PARM_DESC(read_timeout_ms, "Milliseconds allowed for receiving a whole response, 0 uses the built-in timeout");
+
+static int stallTimeoutMsecs = 200;
+module_param_named(stall_timeout_ms, stallTimeoutMsecs, int, 0644);
+MODULE_PARM_DESC(stall_timeout_ms, "Milliseconds without any bulk-in data before a response is abandoned");
+
+static int cmdTimeoutMsecs = 1000;
+module_param_named(cmd_timeout_ms, cmdTimeoutMsecs, int, 0644);
+MODULE_PARM_DESC(cmd_timeout_ms, "Milliseconds allowed for sending a command");
+
+static int maxRetries = USB_READ_MAX_RETRY_CNT;
+module_param_named(max_retries, maxRetries, int, 0644);
+MODULE_PARM_DESC(max_retries, "How many times a failed command is attempted before giving up");
+
+static int retryBackoffMsecs = 10;
+module_param_named(retry_backoff_ms, retryBackoffMsecs, int, 0644);
+MODULE_PARM_DESC(retry_backoff_ms, "Delay before the first retry, doubled for every further retry");
+
+static int retryBackoffMaxMsecs = 1000;
+module_param_named(retry_backoff_max_ms, retryBackoffMaxMsecs, int, 0644);
+MODULE_PARM_DESC(retry_backoff_max_ms, "Upper limit for the retry delay");
+
+static int clearHaltAfter = 2;
+module_param_named(clear_halt_after, clearHaltAfter, int, 0644);
+MODULE_PARM_DESC(clear_halt_after, "Consecutive failures before the endpoint halts are cleared, 0 never clears them");
+
+static int resetAfter = 4;
+module_param_named(reset_after, resetAfter, int, 0644);
+MODULE_PARM_DESC(reset_after, "Consecutive failures before the device is reset, 0 never resets it");
+
+static int entropyPerMille = 500;
+static int set_entropy_per_mille(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops entropyPerMilleOps = {
+	.set = set_entropy_per_mille,
+	.get = param_get_int,
+};
+
+module_param_cb(raw_entropy_per_mille, &entropyPerMilleOps, &entropyPerMille, 0644);
+MODULE_PARM_DESC(raw_entropy_per_mille, "Assumed min-entropy of the raw device output per 1000 bits, used for the entropy estimate");
+
+static unsigned long deliveredBytes;
+
+// Consumer service classes, see TLRANDOM_IOC_SET_QOS
+struct reader_ctx {
+	int qosClass;
+};
+
+// The kernel hwrng framework reads as a normal class reader
+static struct reader_ctx hwrngCtx = { .qosClass = TLRANDOM_QOS_NORMAL };
+
+struct qos_bucket {
+	unsigned long tokens;
+	ktime_t lastFill;
+};
+
+static int defaultQosClass = TLRANDOM_QOS_NORMAL;
+static int qosRateBytes[TLRANDOM_QOS_CLASSES];
+static int bulkWatermarkBytes = 4096;
+
+#ifdef CONFIG_TLRANDOM_QOS
+module_param_named(default_qos, defaultQosClass, int, 0644);
+MODULE_PARM_DESC(default_qos, "Service class of a newly opened file: 0 - critical, 1 - normal, 2 - bulk");
+
+module_param_array_named(qos_rate_bytes, qosRateBytes, int, NULL, 0644);
+MODULE_PARM_DESC(qos_rate_bytes, "Bytes per second each service class may read, with a burst of one second, 0 is unlimited");
+
+module_param_named(bulk_watermark_bytes, bulkWatermarkBytes, int, 0644);
+MODULE_PARM_DESC(bulk_watermark_bytes, "Output buffer bytes kept for the critical and normal classes, bulk readers refill below it");
+#endif
+
+static DEFINE_SPINLOCK(qosLock);
+static struct qos_bucket qosBuckets[TLRANDOM_QOS_CLASSES];
+static atomic_t criticalWaiting = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(qosWait);
+static unsigned long qosDelivered[TLRANDOM_QOS_CLASSES];
+static unsigned long qosThrottled[TLRANDOM_QOS_CLASSES];
+
+// Express pool, a small reservoir that serves short reads without waiting for 'dataOpLock'
+#define EXPRESS_POOL_BYTES (4096)
+#define EXPRESS_MAX_READ_BYTES (256)
+
+static int expressMaxBytes = EXPRESS_MAX_READ_BYTES;
+#ifdef CONFIG_TLRANDOM_EXPRESS
+module_param_named(express_max_bytes, expressMaxBytes, int, 0644);
+MODULE_PARM_DESC(express_max_bytes, "Largest read served from the express pool, at most 256, 0 disables the pool");
+#endif
+
+// Express pool of one NUMA node, allocated on that node
+struct express_pool {
+	spinlock_t lock;
+	int len;
+	int idx;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long delivered;
+	unsigned long fills;
+	uint8_t bytes[EXPRESS_POOL_BYTES];
+};
+
+static struct express_pool *expressPools[MAX_NUMNODES];
+
+// Audit of the handed out bytes. An 8-byte window of the output is an anchor when its low 3 bits are
+// zero, so the anchors depend on the bytes only and not on how the reads split them. A repeated anchor
+// means a byte range was handed out twice.
+#define AUDIT_ANCHOR_MASK (0x7)
+#define AUDIT_BLOOM_ORDER (22)
+#define AUDIT_BLOOM_BITS (1 << AUDIT_BLOOM_ORDER)
+#define AUDIT_BLOOM_HASHES (4)
+#define AUDIT_BLOOM_ANCHORS (AUDIT_BLOOM_BITS / 16)
+#define AUDIT_RECENT_ORDER (17)
+#define AUDIT_RECENT_ANCHORS (1 << AUDIT_RECENT_ORDER)
+#define AUDIT_CHUNK_BYTES (512)
+
+struct audit_anchor {
+	u64 value;
+	struct hlist_node node;
+};
+
+// Two bloom filters, the older one is cleared when the current one is full, and a hash table of the
+// latest anchors that tells a duplicate from a false positive of the filters. With one anchor in 8 byte
+// positions the table confirms duplicates within about the last 1 MB handed out.
+struct audit_state {
+	spinlock_t lock;
+	unsigned long bloom[2][BITS_TO_LONGS(AUDIT_BLOOM_BITS)];
+	int bloomCur;
+	int bloomCount;
+	int recentIdx;
+	struct audit_anchor recent[AUDIT_RECENT_ANCHORS];
+	DECLARE_HASHTABLE(recentTable, AUDIT_RECENT_ORDER);
+	unsigned long anchors;
+	unsigned long bloomHits;
+	unsigned long duplicates;
+};
+
+static int auditMode;
+static struct audit_state *auditState;
+static DEFINE_STATIC_KEY_FALSE(auditEnabled);
+
+#ifdef CONFIG_TLRANDOM_AUDIT
+static int set_audit_mode(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops auditModeOps = {
+	.set = set_audit_mode,
+	.get = param_get_int,
+};
+
+module_param_cb(audit_mode, &auditModeOps, &auditMode, 0644);
+MODULE_PARM_DESC(audit_mode, "Check that no output byte is handed out twice within about the last 1 MB handed out: 0 - off, 1 - on");
+#endif
+
+// Recovery statistics
+static unsigned long retryCount;
+static unsigned long haltClearCount;
+static unsigned long resetCount;
+static bool isProbing;
+
+static int autosuspendDelayMsecs = 2000;
+module_param_named(autosuspend_delay_ms, autosuspendDelayMsecs, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms, "Idle milliseconds before the device is suspended, -1 keeps the device powered");
+
+// Runtime power management state and statistics
+static bool isDevSuspended;
+static bool isRefillWaking;
+static struct work_struct prefetchWork;
+static unsigned long refillCount;
+static unsigned long suspendCount;
+static unsigned long wakeCount;
+static unsigned long prefetchCount;
+static s64 wakeUsLast;
+static s64 wakeUsMax;
+static s64 wakeUsTotal;
+
+static void track_demand(size_t length);
+static int choose_xfer_bytes(int room);
+static int max_cmd_bytes(void);
+static int rcv_cmd_bytes(int byteCnt, uint8_t *dst, int *outLen);
+static int resize_out_buffer(int size, int node);
+static bool has_reservoir_bytes(void);
+static ssize_t read_user_bytes(struct reader_ctx *ctx, char __user *buffer, struct iov_iter *to, size_t length, bool nowait);
+static ssize_t take_qos_tokens(int qosClass, size_t length, bool nowait);
+static char __user *user_dest(char __user *buffer, struct iov_iter *to, size_t offset);
+static bool prefault_user_bytes(char __user *buffer, struct iov_iter *to, size_t length);
+static size_t copy_claimed_bytes(char __user *buffer, struct iov_iter *to, const uint8_t *src, size_t length);
+static void wait_for_copies(void);
+static ssize_t read_reservoir_bytes(int qosClass, char __user *buffer, struct iov_iter *to, size_t length);
+static void reservoir_close(void);
+static void reservoir_open(void);
+static int reservoir_unread(void);
+static unsigned long delivered_bytes(void);
+static void audit_handout(const uint8_t *src, size_t length);
+static void audit_anchor(struct audit_state *st, u64 anchor);
+static void audit_reset(void);
+static int apply_audit_mode(int mode);
+static void return_qos_tokens(int qosClass, size_t length);
+static int lock_for_class(int qosClass, bool nowait);
+static int class_reserve_bytes(int qosClass);
+static int reader_qos_class(struct reader_ctx *ctx);
+static int refill_below(int level);
+static int cond_block_bytes(void);
+static int cond_entropy_per_mille(void);
+static int cond_quality(void);
+static bool is_cond_profile_built(uint32_t profile);
+static uint32_t usb_nonce_device_id(struct usb_device *udev);
+static ssize_t read_express_bytes(char __user *buffer, struct iov_iter *to, size_t length);
+static int fill_express(const uint8_t *src, int length);
+static int express_deficit(void);
+static void clear_express(void);
+static unsigned long express_delivered(void);
+static int alloc_express_pools(void);
+static void free_express_pools(void);
+static int producer_node(void);
+static int place_producer(void);
+static void queue_prefetch(void);
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static __poll_t device_poll(struct file *file, struct poll_table_struct *wait);
+static void kick_refill(void);
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static bool is_replug_expected(void);
+static int wait_for_device(void);
+static int traffic_replay_xfer_bytes(int room);
+static int alloc_urbs(void);
+static void free_urbs(struct tl_device *dev);
+static void tl_device_release(struct kref *kref);
+static bool enter_op(void);
+static void leave_op(void);
+static int submit_bulk_in(struct bulk_in_req *req);
+static int wait_bulk_in(struct bulk_in_req *req, long timeoutMsecs, int *transferred);
+static int transact(char *snd, int sizeSnd, char *rcv, struct tl_cond_stream *cs, int sizeRcv, int opTimeoutSecs);
+static int receive_response(char *buff, struct tl_cond_stream *cs, int length, int opTimeoutSecs);
+static int recover_usb(int failures);
+static int usb_pre_reset(struct usb_interface *interface);
+static int usb_post_reset(struct usb_interface *interface);
+static int wait_urb(struct urb *urb, struct completion *done, long timeoutJiffies, int *transferred);
+static int send_cmd(char *snd, int sizeSnd, int *transferred);
+static void drain_bulk_in(void);
+
+static bool is_entropy_src_rdy(void);
+static bool is_replaying(void);
+static void traffic_record(uint8_t type, int32_t status, const void *data, uint32_t length);
+static void traffic_record_output(const uint8_t *buff, int length);
+static int traffic_replay_cmd(const char *snd, int sizeSnd);
+static int traffic_replay_bulk_in(uint8_t **buff, int *transferred);
+static struct traffic_rec *traffic_rec_at(size_t pos);
+static void traffic_replay_wait(void);
+static int init_traffic(void);
+static void uninit_traffic(void);
+static void init_stats(void);
+static int usb_suspend(struct usb_interface *interface, pm_message_t message);
+static int usb_resume(struct usb_interface *interface);
+static void prefetch_work(struct work_struct *work);
+static int wake_device(void);
+static int query_dev_model(void);
+static int model_default(int value, int modelValue);
+static void startup_work(struct work_struct *work);
+static int run_startup(void);
+static void announce_device(void);
+static int tl_hwrng_read(struct hwrng *rng, void *data, size_t max, bool wait);
+static void update_hwrng(void);
+
 /**
  * A function to handle the event when the expected USB device is plugged in or connected
  *
@@ -91,17 +760,30 @@ static int usb_probe(struct usb_interface *interface, const struct usb_device_id
 	iface_desc = interface->cur_altsetting;
 
 
-	usbData = kmalloc(sizeof(struct usb_data), GFP_KERNEL);
-	if (usbData == NULL) {
+	tlDev = kzalloc(sizeof(struct tl_device), GFP_KERNEL);
+	if (tlDev == NULL) {
 		printk(KERN_ALERT "Out of memory\n");
 		mutex_unlock(&dataOpLock);
 		return -ENOMEM;
 	}
-	memset(usbData, 0x00, sizeof (struct usb_data));
+	kref_init(&tlDev->kref);
+	usbData = &tlDev->usb;
+	init_usb_anchor(&tlDev->urbAnchor);
 
 	usbData->udev = usb_get_dev(interface_to_usbdev(interface));
 	usbData->interface = interface;
 
+	if (!is_replaying()) {
+		// A new device, and a new boot seed from its first raw block. The counter keeps running.
+		tl_cond_initializeNonce(&shaData, usb_nonce_device_id(usbData->udev), COND_SLICE_MAIN);
+	} else {
+		// The replay owns the nonce, the live one is restored with this device when it ends
+		liveState.deviceId = usb_nonce_device_id(usbData->udev);
+		liveState.sliceId = COND_SLICE_MAIN;
+		liveState.bootSeed = 0;
+		liveState.isSeeded = false;
+	}
+
 
 	for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
 		endpoint = &iface_desc->endpoint[i].desc;
@@ -113,12 +795,6 @@ static int usb_probe(struct usb_interface *interface, const struct usb_device_id
 			buffer_size = endpoint->wMaxPacketSize;
 			usbData->bulk_in_size = buffer_size;
 			usbData->bulk_in_endpointAddr = endpoint->bEndpointAddress;
-			usbData->bulk_in_buffer = kmalloc(USB_BUFFER_SIZE, GFP_KERNEL);
-			if (usbData->bulk_in_buffer == NULL) {
-				printk(KERN_ALERT "Could not allocate memory for bulk_in_buffer");
-				retval = -ENOMEM;
-				break;
-			}
 		}
 
 		if (!usbData->bulk_out_endpointAddr &&
@@ -141,340 +817,3378 @@ static int usb_probe(struct usb_interface *interface, const struct usb_device_id
 		retval = -EPERM;
 	}
 
+	if (retval == SUCCESS) {
+		retval = alloc_urbs();
+	}
+
+	if (retval == SUCCESS) {
+		// The probe holds the device lock, so a failing query must not escalate to a reset
+		isProbing = true;
+		retval = query_dev_model();
+		isProbing = false;
+	}
+
+	if (retval == SUCCESS) {
+		// The model may keep more transfers in flight than the defaults used for the query
+		retval = alloc_urbs();
+	}
+
+	if (retval == SUCCESS) {
+		// Keep the output buffer close to the USB controller, the current one stays when this fails
+		WRITE_ONCE(usbNode, dev_to_node(&interface->dev));
+		place_producer();
+	}
+
 	if (retval != SUCCESS) {
 		clean_up_usb();
 	} else {
-		printk(KERN_INFO "------------------------------------------\n");
-		printk(KERN_INFO "-- TL200/100 device connected and ready --\n");
-		printk(KERN_INFO "------------------------------------------\n");
+		printk(KERN_INFO "Device model %s, firmware %x.%02x, serial number %s, %s speed\n", devInfo.model,
+				devInfo.firmware >> 8, devInfo.firmware & 0xff, devInfo.serial, usb_speed_string(devInfo.speed));
 		#ifdef inDebugMode
 		printk(KERN_INFO "Device is using IN bulk address %02X, OUT bulk address %02X, bulk IN size: %d\n", usbData->bulk_in_endpointAddr, usbData->bulk_out_endpointAddr, (int)usbData->bulk_in_size);
 		#endif
+		isDevSuspended = false;
+		if (autosuspendDelayMsecs >= 0) {
+			pm_runtime_set_autosuspend_delay(&usbData->udev->dev, autosuspendDelayMsecs);
+			usb_enable_autosuspend(usbData->udev);
+		}
+		// Readers wait for the startup test and the prefill, the device is announced ready after them
 		isEntropySrcRdy = true;
+		isStartupPending = true;
+		isDeviceGone = false;
+		startupTime = ktime_get();
+		if (producer_node() != NUMA_NO_NODE) {
+			queue_work_node(producer_node(), system_unbound_wq, &startupWork);
+		} else {
+			schedule_work(&startupWork);
+		}
 	}
 
 	mutex_unlock(&dataOpLock);
 	return retval;
 }
+
 /**
- * A function to handle the event when the USB device is unplugged in or disconnected
+ * Run the startup of a plugged in device in the background, then announce it ready and register it
+ * with the hwrng framework, or leave it unused when the startup fails
  *
- * @param struct usb_interface *interface - pointer to the usb_interface structure associated with the device
+ * @param struct work_struct *work - the startup work
  *
  */
-static void usb_disconnect(struct usb_interface *interface) {
-	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
-		printk(KERN_INFO "Could not lock the mutex\n");
-	}
+static void startup_work(struct work_struct *work) {
+	int retval;
 
-	isEntropySrcRdy = false;
-	clean_up_usb();
-	printk(KERN_INFO "USB device disconnected\n");
+	if (!enter_op()) {
+		return;
+	}
+	mutex_lock(&dataOpLock);
+	reservoir_close();
+	retval = run_startup();
+	startupMsecs = ktime_ms_delta(ktime_get(), startupTime);
+	if (retval == SUCCESS) {
+		announce_device();
+	} else {
+		if (!READ_ONCE(tlDev->isDisconnected) && !isShutDown) {
+			printk(KERN_ALERT "USB device failed to start, error %d, replug it to try again\n", retval);
+			startupFailCount++;
+		}
+		isEntropySrcRdy = false;
+	}
+	isStartupPending = false;
+	wake_up_all(&deviceWait);
+	wake_up_interruptible_poll(&readWait, retval == SUCCESS ? EPOLLIN | EPOLLRDNORM : EPOLLHUP);
+	reservoir_open();
 	mutex_unlock(&dataOpLock);
+
+	// The hwrng core reads right away, which takes the lock
+	update_hwrng();
+	leave_op();
 }
 
 /**
- * A function to clean-up the USB allocated resources
- *
+ * Register the device with the hwrng framework with the quality of the current conditioning, or
+ * register it again when the quality changed. A quality of 0 or a device that is not ready leaves it
+ * unregistered. Called without 'dataOpLock' held, it is only taken to read the state since the hwrng
+ * core reads right away.
  *
  */
+static void update_hwrng(void) {
+	int quality;
+	int retval;
+	bool isRdy;
 
-static void clean_up_usb(void) {
-	if (usbData != NULL) {
-		if ( usbData->bulk_out_buffer != NULL) {
-			kfree(usbData->bulk_out_buffer);
-			usbData->bulk_out_buffer = NULL;
-		}
-		if ( usbData->bulk_in_buffer != NULL) {
-			kfree(usbData->bulk_in_buffer);
-			usbData->bulk_in_buffer = NULL;
+	if (!IS_ENABLED(CONFIG_HW_RANDOM) || !useHwrng) {
+		return;
+	}
+	mutex_lock(&hwrngLock);
+	mutex_lock(&dataOpLock);
+	// Replayed bytes were credited when they were recorded, and recorded bytes can be reproduced from
+	// the capture in debugfs
+	quality = is_replaying() || (IS_ENABLED(CONFIG_TLRANDOM_TRAFFIC) && trafficMode == TRAFFIC_RECORD) ? 0 : cond_quality();
+	isRdy = tlDev != NULL && !READ_ONCE(tlDev->isDisconnected) && is_entropy_src_rdy();
+	mutex_unlock(&dataOpLock);
+	if (isHwrngRegistered && (!isRdy || tlHwrng.quality != quality)) {
+		hwrng_unregister(&tlHwrng);
+		isHwrngRegistered = false;
+	}
+	if (!isHwrngRegistered && isRdy && quality > 0) {
+		tlHwrng.name = DEVICE_NAME;
+		tlHwrng.read = tl_hwrng_read;
+		tlHwrng.quality = quality;
+		retval = hwrng_register(&tlHwrng);
+		if (retval != SUCCESS) {
+			printk(KERN_ALERT "Could not register with the hwrng framework, error %d\n", retval);
+		} else {
+			isHwrngRegistered = true;
 		}
-		kfree(usbData);
-		usbData = NULL;
 	}
+	mutex_unlock(&hwrngLock);
 }
 
 /**
- * A function to handle the event when device is open
+ * Test a plugged in device before its output is used: the raw bytes of the first refill go through the
+ * health tests with the cutoffs of 'raw_entropy_per_mille' and its output is dropped, the refills after it
+ * fill the output buffer with 'startup_prefill_bytes'. Called with 'dataOpLock' held and the reservoir closed.
  *
- * @param struct inode *inode - pointer to the inode structure of the caller
- * @param struct file *file -  pointer to the file structure of the caller
- * @return 0 - successfully, otherwise the error code (a negative number)
+ * @return 0 - the device passed and the output is buffered, otherwise the error code (a negative number)
  *
  */
-static int device_open(struct inode *inode, struct file *file)
-{
-	int status = SUCCESS;
-	unsigned int mj = imajor(inode);
-	unsigned int mn = iminor(inode);
+static int run_startup(void) {
+	int kept;
+	int target;
+	int retval;
 
-	if (mj != major || mn != minor) {
-		printk(KERN_ALERT "No device found with major=%d and minor=%d\n",	mj, mn);
-		return -ENODEV;
+	if (is_replaying()) {
+		// The recorded traffic was tested when it was recorded
+		return SUCCESS;
 	}
 
-	if (!isEntropySrcRdy || isShutDown) {
-		status = -ENODATA;
+	// Bytes buffered before an unplug stay, they passed the tests of their own refill. The oldest of
+	// them make room for the test when the buffer is nearly full.
+	kept = trngOutLen - curTrngOutIdx;
+	if (outBufferBytes - kept < MIN_OUT_BUFFER_BYTES) {
+		memzero_explicit(buffTRndOut + curTrngOutIdx, MIN_OUT_BUFFER_BYTES - (outBufferBytes - kept));
+		curTrngOutIdx += MIN_OUT_BUFFER_BYTES - (outBufferBytes - kept);
+		kept = trngOutLen - curTrngOutIdx;
 	}
+	tl_rct_restart(&rctData);
+	tl_apt_restart(&aptData);
+	tl_rct_initialize(&rawRctData, TLRANDOM_FAIL_THRESHOLD);
+	tl_apt_initialize(&rawAptData, TLRANDOM_FAIL_THRESHOLD);
+	tl_health_setRawCutoffs(&rawRctData, &rawAptData, entropyPerMille);
+	readPending = STARTUP_TEST_BYTES;
+	isRawTestPending = true;
+	retval = rcv_rnd_bytes();
+	isRawTestPending = false;
+	if (retval == SUCCESS && rawRctData.statusByte != SUCCESS) {
+		printk(KERN_ALERT "Repetition Count Test failure on the raw bytes of the startup test\n");
+		retval = -EPERM;
+	} else if (retval == SUCCESS && rawAptData.statusByte != SUCCESS) {
+		printk(KERN_ALERT "Adaptive Proportion Test failure on the raw bytes of the startup test\n");
+		retval = -EPERM;
+	}
+	if (retval != SUCCESS) {
+		return retval;
+	}
+	memzero_explicit(buffTRndOut + kept, trngOutLen - kept);
+	trngOutLen = kept;
 
-	return status;
+	target = clamp(startupPrefillBytes, 0, outBufferBytes - MIN_OUT_BUFFER_BYTES);
+	while (trngOutLen - curTrngOutIdx < target) {
+		if (isShutDown || READ_ONCE(tlDev->isDisconnected)) {
+			return -ENODEV;
+		}
+		readPending = target - (trngOutLen - curTrngOutIdx);
+		retval = rcv_rnd_bytes();
+		if (retval != SUCCESS) {
+			return retval;
+		}
+	}
+	readPending = 0;
+	if (express_deficit() > 0) {
+		curTrngOutIdx += fill_express(buffTRndOut + curTrngOutIdx, trngOutLen - curTrngOutIdx);
+	}
+	return SUCCESS;
 }
 
 /**
- * A function to handle the event when device is closed
- *
- * @param struct inode *inode - pointer to the inode structure of the caller
- * @param struct file *file -  pointer to the file structure of the caller
- * @return 0 - successfully, otherwise the error code (a negative number)
+ * Announce a device that passed its startup. Called with 'dataOpLock' held.
  *
  */
-static int device_release(struct inode *inode, struct file *file)
-{
-	return SUCCESS;
+static void announce_device(void) {
+	printk(KERN_INFO "------------------------------------------\n");
+	printk(KERN_INFO "-- TL200/100 device connected and ready --\n");
+	printk(KERN_INFO "------------------------------------------\n");
+	printk(KERN_INFO "Device started in %lld ms with %d bytes buffered\n", startupMsecs, trngOutLen - curTrngOutIdx);
 }
 
 /**
- * A function to handle the event when caller requests a device read operation
+ * Supply random bytes to the kernel hwrng framework from the output buffer, the same way a reader does
  *
- * @param struct file *file - pointer to the file structure of the caller
- * @param char __user *buffer - pointer to the buffer in the user space
- * @param size_t length - size in bytes for the read operation
- * @param loff_t * offset
- * @return greater than 0 - number of bytes actually read, otherwise the error code (a negative number)
+ * @param struct hwrng *rng - the registered hwrng
+ * @param void *data - the kernel buffer to fill
+ * @param size_t max - size of the buffer in bytes
+ * @param bool wait - wait for a refill when the output buffer is empty
+ * @return int - number of bytes supplied, otherwise the error code (a negative number)
  *
  */
-static ssize_t device_read(struct file *file, char __user *buffer, size_t length, loff_t * offset)
-{
-	ssize_t retval = SUCCESS;
-	size_t act;
-	size_t total;
-
-	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
-		printk(KERN_ALERT "Could not lock the mutex\n");
-		return -EPERM;
-	}
-
-
-	if (!isEntropySrcRdy || isShutDown) {
-		retval = -ENODATA;
-	} else {
-		isDeviceOpPending = true;
-		total = 0;
-		do {
-			retval = get_entropy_bytes();
-			if (retval == SUCCESS) {
-				act = TRND_OUT_BUFFSIZE - curTrngOutIdx;
-				if (act > (length - total)) {
-					act = (length - total);
-				}
-				if (copy_to_user(buffer + total, buffTRndOut + curTrngOutIdx, act)) {
-					retval = -EFAULT;
-					break;
-				} else {
-					curTrngOutIdx += act;
-					total += act;
-					retval = total;
-				}
-			} else {
-				break;
-			}
-		} while (total < length);
-	#ifdef inDebugMode
-		if (total > length) {
-			printk(KERN_ALERT "Expected %d bytes to read and actually got %d \n", (int)length, (int)total);
-		}
-	#endif
+static int tl_hwrng_read(struct hwrng *rng, void *data, size_t max, bool wait) {
+	struct kvec kv = { .iov_base = data, .iov_len = max };
+	struct iov_iter to;
+	ssize_t retval;
 
+	iov_iter_kvec(&to, ITER_DEST, &kv, 1, max);
+	retval = read_user_bytes(&hwrngCtx, NULL, &to, max, !wait);
+	if (retval == -EAGAIN) {
+		// Nothing buffered, the hwrng core asks again
+		return 0;
 	}
-	isDeviceOpPending = false;
-	mutex_unlock(&dataOpLock);
-	return retval;
+	return (int)retval;
 }
-
 /**
- * A function to request new entropy bytes when running out of entropy in the local buffer
+ * Derive the device ID of the conditioning nonce from the USB IDs and the serial number of the
+ * device, or its port path when it has no serial number. Called with 'dataOpLock' held.
  *
- * @return 0 - successful operation, otherwise the error code (a negative number)
+ * @param struct usb_device *udev - the USB device
+ * @return uint32_t - the device ID
  *
  */
-static int get_entropy_bytes(void) {
-	int status;
-	if(curTrngOutIdx >= TRND_OUT_BUFFSIZE) {
-		status = rcv_rnd_bytes();
-	} else {
-		status = SUCCESS;
-	}
-	return status;
+static uint32_t usb_nonce_device_id(struct usb_device *udev) {
+	static struct tl_sha256_data idShaData;
+	uint32_t words[TL_SHA256_BLOCK_WORDS];
+	uint32_t digest[TL_SHA256_OUT_WORDS];
+
+	memset(words, 0, sizeof(words));
+	words[0] = le16_to_cpu(udev->descriptor.idVendor) << 16 | le16_to_cpu(udev->descriptor.idProduct);
+	strscpy((char *)(words + 1), udev->serial != NULL ? udev->serial : udev->devpath, sizeof(words) - sizeof(words[0]));
+	tl_sha256_generateHash(&idShaData, words, TL_SHA256_BLOCK_WORDS, digest);
+	return digest[0];
 }
 
 /**
- * A function to fill the buffer with new entropy bytes
+ * Read the device model with the 'm' command and keep it with the firmware revision, the serial number
+ * and the bus capabilities of the device. The model picks the transfer defaults, a device that does not
+ * answer the query or reports a model not listed in 'tlModels' gets the defaults of an unknown model.
+ * Called with 'dataOpLock' held at probe time.
  *
- * @return 0 - successful operation, otherwise the error code (a negative number)
+ * @return 0 - successful operation, otherwise the error code (a negative number) when the device is gone
  *
  */
-static int rcv_rnd_bytes(void) {
+static int query_dev_model(void) {
+	struct usb_device *udev = usbData->udev;
+	char model[DEV_MODEL_BYTES + 1];
 	int retval;
-   	uint8_t lowByteCount;
-   	uint8_t highByteCount;
-   	uint16_t byteCnt;
-   	int i,j;
-   	uint32_t *dst;
-
-	if (!isEntropySrcRdy || isShutDown) {
-		return -EPERM;
-	}
+	int i;
 
-	isUsbOpPending = true;
+	devInfo.firmware = le16_to_cpu(udev->descriptor.bcdDevice);
+	strscpy(devInfo.serial, udev->serial != NULL ? udev->serial : "", sizeof(devInfo.serial));
+	devInfo.maxPacket = usbData->bulk_in_size;
+	devInfo.speed = udev->speed;
+	// Nothing of the previous device is kept
+	devModel = &tlModels[TL_MODEL_UNKNOWN];
+	strscpy(devInfo.model, devModel->name, sizeof(devInfo.model));
 
-	byteCnt = RND_IN_BUFFSIZE;
-   	lowByteCount  = byteCnt & 0x00ff;
-   	highByteCount = byteCnt >> 8;
+	if (is_replaying()) {
+		// The recorded traffic stands in for the device, it holds no answer to the query
+		return SUCCESS;
+	}
 
-   	usbData->bulk_out_buffer[0] = 'x';
-	usbData->bulk_out_buffer[1] = lowByteCount;
-	usbData->bulk_out_buffer[2] = highByteCount;
+	// Not part of the data stream, so it is left out of a recording
+	usbData->bulk_out_buffer[0] = 'm';
+	isTrafficSkipped = true;
+	retval = snd_rcv_usb_data(usbData->bulk_out_buffer, 1, model, DEV_MODEL_BYTES, USB_READ_TIMEOUT_SECS);
+	isTrafficSkipped = false;
+	if (retval == -ENODEV) {
+		return retval;
+	}
+	if (retval != SUCCESS) {
+		// Firmware without the query, the transfers keep the defaults of the baseline driver
+		printk(KERN_WARNING "Could not read the USB device model, error %d, using the defaults\n", retval);
+		return SUCCESS;
+	}
 
-	retval = snd_rcv_usb_data(usbData->bulk_out_buffer, 3, buffRndIn, RND_IN_BUFFSIZE, USB_READ_TIMEOUT_SECS);
-	if (retval == SUCCESS) {
-		dst = (uint32_t *)buffTRndOut;
-		rct_restart();
-		apt_restart();
-		for (i = 0; i < RND_IN_BUFFSIZE / WORD_SIZE_BYTES; i += MIN_INPUT_NUM_WORDS) {
-			for (j = 0; j < MIN_INPUT_NUM_WORDS; j++) {
-				srcToHash[j] = ((uint32_t *)buffRndIn)[i+j];
-			}
-			sha256_stampSerialNumber(srcToHash);
-			sha256_generateHash(srcToHash, MIN_INPUT_NUM_WORDS + 1, dst);
-			dst += OUT_NUM_WORDS;
+	// The status byte follows the space padded name
+	model[DEV_MODEL_BYTES] = '\0';
+	for (i = DEV_MODEL_BYTES; i > 0 && model[i - 1] == ' '; i--) {
+		model[i - 1] = '\0';
+	}
+	for (i = TL_MODEL_UNKNOWN + 1; i < ARRAY_SIZE(tlModels); i++) {
+		if (strcmp(model, tlModels[i].name) == 0) {
+			break;
 		}
-		curTrngOutIdx = 0;
-		for (i = 0; i < TRND_OUT_BUFFSIZE; i++) {
-			rct_sample(buffTRndOut[i]);
-			apt_sample(buffTRndOut[i]);
+	}
+	if (i == ARRAY_SIZE(tlModels)) {
+		printk(KERN_WARNING "USB device model '%s' unknown, using the defaults\n", model);
+		return SUCCESS;
+	}
+	devModel = &tlModels[i];
+	strscpy(devInfo.model, model, sizeof(devInfo.model));
+	return SUCCESS;
+}
+
+/**
+ * Get the value of a transfer module parameter, or the default of the device model when it is 0
+ *
+ * @param int value - the module parameter
+ * @param int modelValue - the default of the device model
+ * @return int - the value to use
+ *
+ */
+static int model_default(int value, int modelValue) {
+	return value > 0 ? value : modelValue;
+}
+
+/*
+ * The device information and the transfer values in use, in the 'tlrandom' group of the USB interface:
+ * cat /sys/bus/usb/drivers/tlrandom/<interface>/tlrandom/model
+ */
+static ssize_t model_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%s\n", devInfo.model);
+}
+static DEVICE_ATTR_RO(model);
+
+static ssize_t firmware_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%x.%02x\n", devInfo.firmware >> 8, devInfo.firmware & 0xff);
+}
+static DEVICE_ATTR_RO(firmware);
+
+static ssize_t serial_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%s\n", devInfo.serial);
+}
+static DEVICE_ATTR_RO(serial);
+
+static ssize_t speed_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%s\n", usb_speed_string(devInfo.speed));
+}
+static DEVICE_ATTR_RO(speed);
+
+static ssize_t max_packet_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%d\n", devInfo.maxPacket);
+}
+static DEVICE_ATTR_RO(max_packet);
+
+static ssize_t inflight_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%d\n", clamp(model_default(maxInflight, devModel->inflight), 1, MAX_INFLIGHT_URBS));
+}
+static DEVICE_ATTR_RO(inflight);
+
+static ssize_t min_xfer_bytes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%d\n", model_default(READ_ONCE(minXferBytes), devModel->minXferBytes));
+}
+static DEVICE_ATTR_RO(min_xfer_bytes);
+
+static ssize_t max_xfer_bytes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%d\n", model_default(READ_ONCE(maxXferBytes), devModel->maxXferBytes));
+}
+static DEVICE_ATTR_RO(max_xfer_bytes);
+
+static ssize_t expected_rate_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	return sysfs_emit(buf, "%d\n", devModel->expectedRate);
+}
+static DEVICE_ATTR_RO(expected_rate);
+
+static struct attribute *tlDevAttrs[] = {
+	&dev_attr_model.attr,
+	&dev_attr_firmware.attr,
+	&dev_attr_serial.attr,
+	&dev_attr_speed.attr,
+	&dev_attr_max_packet.attr,
+	&dev_attr_inflight.attr,
+	&dev_attr_min_xfer_bytes.attr,
+	&dev_attr_max_xfer_bytes.attr,
+	&dev_attr_expected_rate.attr,
+	NULL,
+};
+
+static const struct attribute_group tlDevGroup = {
+	.name = "tlrandom",
+	.attrs = tlDevAttrs,
+};
+
+static const struct attribute_group *tlDevGroups[] = {
+	&tlDevGroup,
+	NULL,
+};
+
+/**
+ * A function to handle the event when the USB device is unplugged in or disconnected
+ *
+ * @param struct usb_interface *interface - pointer to the usb_interface structure associated with the device
+ *
+ */
+static void usb_disconnect(struct usb_interface *interface) {
+	// Abort a transfer in progress, so a reader holding the lock leaves without waiting for a timeout
+	if (tlDev != NULL) {
+		WRITE_ONCE(tlDev->isDisconnected, true);
+		usb_kill_anchored_urbs(&tlDev->urbAnchor);
+	}
+
+	// The startup and the prefetch take the lock themselves
+	cancel_work_sync(&startupWork);
+	cancel_work_sync(&prefetchWork);
+	mutex_lock(&hwrngLock);
+	if (IS_ENABLED(CONFIG_HW_RANDOM) && isHwrngRegistered) {
+		// Waits for a read in progress, which ends on the disconnected device
+		hwrng_unregister(&tlHwrng);
+		isHwrngRegistered = false;
+	}
+	mutex_unlock(&hwrngLock);
+
+	mutex_lock(&dataOpLock);
+	isEntropySrcRdy = false;
+	isStartupPending = false;
+	// The output buffer is kept, readers drain it while the device is away
+	isDeviceGone = true;
+	disconnectTime = ktime_get();
+	disconnectCount++;
+	clean_up_usb();
+	wake_up_interruptible_poll(&readWait, EPOLLHUP);
+	printk(KERN_INFO "USB device disconnected\n");
+	mutex_unlock(&dataOpLock);
+}
+
+/**
+ * A function to handle the event when the USB device is suspended. Refills hold a runtime PM
+ * reference, so an autosuspend never interrupts one.
+ *
+ * @param struct usb_interface *interface - pointer to the usb_interface structure associated with the device
+ * @param pm_message_t message - the power management event
+ * @return 0 - always
+ *
+ */
+static int usb_suspend(struct usb_interface *interface, pm_message_t message) {
+	if (tlDev != NULL) {
+		usb_kill_anchored_urbs(&tlDev->urbAnchor);
+	}
+	isDevSuspended = true;
+	suspendCount++;
+	return SUCCESS;
+}
+
+/**
+ * A function to handle the event when the USB device is resumed. Unless a refill woke the device,
+ * the output buffer is refilled in the background so it is ready for the next reader.
+ *
+ * @param struct usb_interface *interface - pointer to the usb_interface structure associated with the device
+ * @return 0 - always
+ *
+ */
+static int usb_resume(struct usb_interface *interface) {
+	isDevSuspended = false;
+	if (!isRefillWaking) {
+		queue_prefetch();
+	}
+	return SUCCESS;
+}
+
+/**
+ * A function to handle the event before the USB device is reset, the transfers in progress are cancelled.
+ * 'dataOpLock' is held until usb_post_reset(), so no transfer is submitted during the reset.
+ *
+ * @param struct usb_interface *interface - pointer to the usb_interface structure associated with the device
+ * @return 0 - always
+ *
+ */
+static int usb_pre_reset(struct usb_interface *interface) {
+	if (tlDev != NULL) {
+		// A refill holding the lock gives up instead of retrying, then the lock is taken
+		WRITE_ONCE(tlDev->isResetting, true);
+		usb_kill_anchored_urbs(&tlDev->urbAnchor);
+	}
+	mutex_lock(&dataOpLock);
+	return SUCCESS;
+}
+
+/**
+ * A function to handle the event after the USB device is reset
+ *
+ * @param struct usb_interface *interface - pointer to the usb_interface structure associated with the device
+ * @return 0 - always
+ *
+ */
+static int usb_post_reset(struct usb_interface *interface) {
+	if (tlDev != NULL) {
+		// Anything received before the next command belongs to an earlier one
+		tlDev->needsDrain = true;
+		WRITE_ONCE(tlDev->isResetting, false);
+	}
+	mutex_unlock(&dataOpLock);
+	return SUCCESS;
+}
+
+/**
+ * Top up the express pool and refill a low output buffer in the background
+ *
+ * @param struct work_struct *work - the prefetch work item
+ *
+ */
+static void prefetch_work(struct work_struct *work) {
+	int taken;
+
+	if (!enter_op()) {
+		return;
+	}
+	mutex_lock(&dataOpLock);
+	reservoir_close();
+	if (express_deficit() > 0 && has_reservoir_bytes()) {
+		taken = fill_express(buffTRndOut + curTrngOutIdx, trngOutLen - curTrngOutIdx);
+		curTrngOutIdx += taken;
+	}
+	if (is_entropy_src_rdy() && !is_replaying() && trngOutLen - curTrngOutIdx <= class_reserve_bytes(TLRANDOM_QOS_BULK)) {
+		// Sized by the demand history alone, no reader is waiting yet
+		readPending = 0;
+		if (refill_below(class_reserve_bytes(TLRANDOM_QOS_BULK)) == SUCCESS) {
+			prefetchCount++;
+		}
+	}
+	reservoir_open();
+	mutex_unlock(&dataOpLock);
+	leave_op();
+}
+
+/**
+ * A function to release the USB binding, the resources are freed once the last refill is done with them
+ *
+ *
+ */
+
+static void clean_up_usb(void) {
+	struct tl_device *dev = tlDev;
+
+	if (dev != NULL) {
+		tlDev = NULL;
+		usbData = NULL;
+		kref_put(&dev->kref, tl_device_release);
+	}
+}
+
+/**
+ * Free the USB allocated resources when the last reference to the device is dropped
+ *
+ * @param struct kref *kref - the reference counter of the device
+ *
+ */
+static void tl_device_release(struct kref *kref) {
+	struct tl_device *dev = container_of(kref, struct tl_device, kref);
+
+	free_urbs(dev);
+	kfree(dev->usb.bulk_out_buffer);
+	usb_put_dev(dev->usb.udev);
+	kfree(dev);
+}
+
+/**
+ * Allocate the command URB, and the bulk-in URBs and transfer buffers missing for the in-flight depth
+ * of the device model
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int alloc_urbs(void) {
+	int i;
+	struct bulk_in_req *req;
+
+	if (tlDev->cmdUrb == NULL) {
+		init_completion(&tlDev->cmdDone);
+		tlDev->cmdUrb = usb_alloc_urb(0, GFP_KERNEL);
+		if (tlDev->cmdUrb == NULL) {
+			printk(KERN_ALERT "Could not allocate memory for bulk-out transfers");
+			return -ENOMEM;
+		}
+	}
+
+	tlDev->numBulkIn = clamp(model_default(maxInflight, devModel->inflight), 1, MAX_INFLIGHT_URBS);
+	for (i = 0; i < tlDev->numBulkIn; i++) {
+		req = &tlDev->bulkIn[i];
+		if (req->buffer != NULL) {
+			// Allocated for a smaller depth before
+			continue;
+		}
+		init_completion(&req->done);
+		req->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (req->urb == NULL) {
+			printk(KERN_ALERT "Could not allocate memory for bulk-in transfers");
+			return -ENOMEM;
+		}
+		// Received by DMA straight into the buffer the data is conditioned from
+		req->buffer = usb_alloc_coherent(usbData->udev, USB_BUFFER_SIZE, GFP_KERNEL, &req->urb->transfer_dma);
+		if (req->buffer == NULL) {
+			printk(KERN_ALERT "Could not allocate memory for bulk-in transfers");
+			return -ENOMEM;
+		}
+		req->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Cancel and free the URBs and the bulk-in transfer buffers
+ *
+ * @param struct tl_device *dev - the device
+ *
+ */
+static void free_urbs(struct tl_device *dev) {
+	int i;
+
+	usb_kill_anchored_urbs(&dev->urbAnchor);
+	usb_free_urb(dev->cmdUrb);
+	dev->cmdUrb = NULL;
+	for (i = 0; i < MAX_INFLIGHT_URBS; i++) {
+		if (dev->bulkIn[i].buffer != NULL) {
+			usb_free_coherent(dev->usb.udev, USB_BUFFER_SIZE, dev->bulkIn[i].buffer, dev->bulkIn[i].urb->transfer_dma);
+			dev->bulkIn[i].buffer = NULL;
+		}
+		usb_free_urb(dev->bulkIn[i].urb);
+		dev->bulkIn[i].urb = NULL;
+	}
+}
+
+/**
+ * A function to handle the event when device is open
+ *
+ * @param struct inode *inode - pointer to the inode structure of the caller
+ * @param struct file *file -  pointer to the file structure of the caller
+ * @return 0 - successfully, otherwise the error code (a negative number)
+ *
+ */
+static int device_open(struct inode *inode, struct file *file)
+{
+	int status = SUCCESS;
+	unsigned int mj = imajor(inode);
+	unsigned int mn = iminor(inode);
+	struct reader_ctx *ctx;
+
+	if (mj != major || mn != minor) {
+		printk(KERN_ALERT "No device found with major=%d and minor=%d\n",	mj, mn);
+		return -ENODEV;
+	}
+
+	if (!is_entropy_src_rdy() && !has_reservoir_bytes() && !is_replug_expected()) {
+		status = -ENODATA;
+	} else {
+		ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+		if (ctx == NULL) {
+			return -ENOMEM;
+		}
+		ctx->qosClass = TLRANDOM_QOS_NORMAL;
+		if (defaultQosClass >= TLRANDOM_QOS_NORMAL && defaultQosClass < TLRANDOM_QOS_CLASSES) {
+			ctx->qosClass = defaultQosClass;
+		}
+		file->private_data = ctx;
+		// Lets io_uring try IOCB_NOWAIT reads inline before punting them to a worker
+		file->f_mode |= FMODE_NOWAIT;
+	}
+
+	return status;
+}
+
+/**
+ * A function to handle the event when device is closed
+ *
+ * @param struct inode *inode - pointer to the inode structure of the caller
+ * @param struct file *file -  pointer to the file structure of the caller
+ * @return 0 - successfully, otherwise the error code (a negative number)
+ *
+ */
+static int device_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	file->private_data = NULL;
+	return SUCCESS;
+}
+
+/**
+ * A function to handle the event when caller requests a device read operation
+ *
+ * @param struct file *file - pointer to the file structure of the caller
+ * @param char __user *buffer - pointer to the buffer in the user space
+ * @param size_t length - size in bytes for the read operation
+ * @param loff_t * offset
+ * @return greater than 0 - number of bytes actually read, otherwise the error code (a negative number)
+ *
+ */
+static ssize_t device_read(struct file *file, char __user *buffer, size_t length, loff_t * offset)
+{
+	return read_user_bytes(file->private_data, buffer, NULL, length, file->f_flags & O_NONBLOCK);
+}
+
+/**
+ * A function to handle asynchronous and vectored read requests. With IOCB_NOWAIT only bytes already
+ * in the output buffer are returned, an empty buffer gives -EAGAIN and starts a background refill
+ * that is announced through poll.
+ *
+ * @param struct kiocb *iocb - the I/O control block of the request
+ * @param struct iov_iter *to - the destination buffers
+ * @return greater than 0 - number of bytes actually read, otherwise the error code (a negative number)
+ *
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	bool nowait = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+
+	return read_user_bytes(iocb->ki_filp->private_data, NULL, to, iov_iter_count(to), nowait);
+}
+
+/**
+ * A function to handle poll requests, the device is readable when the output buffer holds bytes
+ * the service class of the file may read
+ *
+ * @param struct file *file - pointer to the file structure of the caller
+ * @param struct poll_table_struct *wait - the poll table
+ * @return __poll_t - the poll events
+ *
+ */
+static __poll_t device_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct reader_ctx *ctx = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &readWait, wait);
+	if (reservoir_unread() > class_reserve_bytes(reader_qos_class(ctx))) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	} else if (!is_entropy_src_rdy() && !is_replug_expected()) {
+		mask |= EPOLLHUP;
+	} else {
+		kick_refill();
+	}
+	return mask;
+}
+
+/**
+ * Start a background refill of an empty or low output buffer, readers are woken up through poll when done
+ *
+ */
+static void kick_refill(void) {
+	if (is_entropy_src_rdy()) {
+		queue_prefetch();
+	}
+}
+
+/**
+ * Queue the background refill on the producer node, so the conditioning runs next to the USB
+ * controller and the output buffer
+ *
+ */
+static void queue_prefetch(void) {
+	int node = producer_node();
+
+	if (node != NUMA_NO_NODE) {
+		queue_work_node(node, system_unbound_wq, &prefetchWork);
+	} else {
+		schedule_work(&prefetchWork);
+	}
+}
+
+/**
+ * Get the NUMA node of the output buffer and the background refills
+ *
+ * @return int - the 'producer_node' module parameter, the node of the USB host controller when it is -1
+ *
+ */
+static int producer_node(void) {
+	int node = READ_ONCE(producerNodeParam);
+
+	return node != NUMA_NO_NODE ? node : READ_ONCE(usbNode);
+}
+
+/**
+ * Move the output buffer to the producer node. Called with 'dataOpLock' held.
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int place_producer(void) {
+	int node = producer_node();
+
+	if (node == NUMA_NO_NODE || node == outBufferNode) {
+		return SUCCESS;
+	}
+	return resize_out_buffer(outBufferBytes, node);
+}
+
+/**
+ * Change the producer node, a handler for writing the 'producer_node' module parameter
+ *
+ * @param const char *val - the node number, -1 for the node of the USB host controller
+ * @param const struct kernel_param *kp - the parameter
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int set_producer_node(const char *val, const struct kernel_param *kp) {
+	int node;
+	int retval;
+
+	retval = kstrtoint(val, 0, &node);
+	if (retval) {
+		return retval;
+	}
+	if (node != NUMA_NO_NODE && (node < 0 || node >= MAX_NUMNODES || !node_online(node))) {
+		return -EINVAL;
+	}
+
+	if (!isOutBufferRdy) {
+		// Set when loading the module, the buffer is allocated on it later
+		WRITE_ONCE(producerNodeParam, node);
+		return SUCCESS;
+	}
+
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		return -EINTR;
+	}
+	WRITE_ONCE(producerNodeParam, node);
+	retval = place_producer();
+	mutex_unlock(&dataOpLock);
+	return retval;
+}
+
+/**
+ * Copy random bytes to user space, refilling the output buffer as needed. The service class of the
+ * reader decides the rate limit, the order of taking the lock and how low the output buffer may go.
+ * 'dataOpLock' is only held to refill and to claim a range of the output buffer, the claimed range is
+ * copied after the lock is released into a destination faulted in beforehand.
+ *
+ * @param struct reader_ctx *ctx - the reader context of the open file
+ * @param char __user *buffer - pointer to the buffer in the user space, used when 'to' is NULL
+ * @param struct iov_iter *to - the destination buffers, NULL to copy to 'buffer'
+ * @param size_t length - size in bytes for the read operation
+ * @param bool nowait - return only bytes already buffered, never wait for the lock, the device or the rate limit
+ * @return greater than 0 - number of bytes actually read, otherwise the error code (a negative number)
+ *
+ */
+static ssize_t read_user_bytes(struct reader_ctx *ctx, char __user *buffer, struct iov_iter *to, size_t length, bool nowait)
+{
+	ssize_t retval = SUCCESS;
+	ssize_t granted;
+	size_t act;
+	size_t copied;
+	size_t total;
+	const uint8_t *src;
+	int reserve;
+	int qosClass = reader_qos_class(ctx);
+	bool isLocked;
+
+	if (!enter_op()) {
+		return -ENODATA;
+	}
+	// Rate limited readers get what their class may read now, a short read is still a read
+	granted = take_qos_tokens(qosClass, length, nowait);
+	if (granted < 0) {
+		leave_op();
+		return granted;
+	}
+	length = granted;
+
+	if (qosClass != TLRANDOM_QOS_BULK) {
+		retval = read_express_bytes(buffer, to, length);
+		if (retval != 0) {
+			if (retval < 0) {
+				return_qos_tokens(qosClass, length);
+			}
+			leave_op();
+			return retval;
+		}
+	}
+
+	// Page faults on the destination are taken here, never while the lock is held or a range is claimed
+	if (length > 0 && !prefault_user_bytes(buffer, to, min(length, (size_t)outBufferBytes))) {
+		return_qos_tokens(qosClass, length);
+		leave_op();
+		return -EFAULT;
+	}
+
+	// Bytes already conditioned are claimed without the lock, it is only taken to refill
+	retval = read_reservoir_bytes(qosClass, buffer, to, length);
+	if (retval < 0 || retval == length) {
+		if (retval < 0) {
+			return_qos_tokens(qosClass, length);
+		} else {
+			atomic_long_add(length, &lockFreeDemandBytes);
+		}
+		leave_op();
+		return retval;
+	}
+	total = retval;
+	if (total > 0 && !prefault_user_bytes(user_dest(buffer, to, total), to, min(length - total, (size_t)outBufferBytes))) {
+		return_qos_tokens(qosClass, length - total);
+		leave_op();
+		return total;
+	}
+
+	if (!nowait && reservoir_unread() <= class_reserve_bytes(qosClass)) {
+		// A replayed refill keeps its recorded timing without holding up the others
+		traffic_replay_wait();
+	}
+	atomic_inc(&readersQueued);
+	retval = lock_for_class(qosClass, nowait);
+	if (retval != SUCCESS) {
+		atomic_dec(&readersQueued);
+		return_qos_tokens(qosClass, length - total);
+		leave_op();
+		return total > 0 ? total : retval;
+	}
+	isLocked = true;
+	reservoir_close();
+
+	if (!is_entropy_src_rdy() && !has_reservoir_bytes() && !is_replug_expected()) {
+		retval = total > 0 ? total : -ENODATA;
+	} else {
+		isDeviceOpPending = true;
+		track_demand(length);
+		do {
+			reserve = class_reserve_bytes(qosClass);
+			if (total > 0 && signal_pending(current)) {
+				// Return what was read so far
+				break;
+			}
+			if (trngOutLen - curTrngOutIdx <= reserve && nowait) {
+				kick_refill();
+				retval = total > 0 ? total : -EAGAIN;
+				break;
+			}
+			if (trngOutLen - curTrngOutIdx <= reserve && !is_entropy_src_rdy()) {
+				// The reservoir ran dry while the device is away
+				retval = wait_for_device();
+				if (retval != SUCCESS) {
+					if (total > 0) {
+						retval = total;
+					}
+					break;
+				}
+				continue;
+			}
+			readPending = length - total;
+			retval = refill_below(reserve);
+			if (retval == SUCCESS && trngOutLen - curTrngOutIdx <= reserve) {
+				// The refill had no room left, which only happens when the buffer shrank
+				retval = -EAGAIN;
+			}
+			if (retval == SUCCESS) {
+				act = trngOutLen - curTrngOutIdx - reserve;
+				if (act > (length - total)) {
+					act = (length - total);
+				}
+				// Claim the range, a refill or a resize waits for the copy before it moves the bytes
+				src = buffTRndOut + curTrngOutIdx;
+				curTrngOutIdx += act;
+				deliveredBytes += act;
+				if (outBufferNode != NUMA_NO_NODE && numa_node_id() != outBufferNode) {
+					atomic_long_add(act, &crossNodeReadBytes);
+				}
+				qosDelivered[qosClass] += act;
+				atomic_inc(&copiesInFlight);
+				reservoir_open();
+				mutex_unlock(&dataOpLock);
+				isLocked = false;
+
+				copied = copy_claimed_bytes(user_dest(buffer, to, total), to, src, act);
+				if (atomic_dec_and_test(&copiesInFlight)) {
+					wake_up_all(&copiesDone);
+				}
+				total += copied;
+				retval = total;
+				if (act > 0 && copied == 0) {
+					// The destination cannot be written, the claimed bytes are dropped
+					retval = total > 0 ? total : -EFAULT;
+					break;
+				}
+				if (total >= length) {
+					break;
+				}
+				// A page reclaimed after the prefault ends a copy early, the rest of that claim is dropped
+				if (!prefault_user_bytes(user_dest(buffer, to, total), to, min(length - total, (size_t)outBufferBytes))) {
+					break;
+				}
+				if (!nowait && reservoir_unread() <= class_reserve_bytes(qosClass)) {
+					traffic_replay_wait();
+				}
+				if (lock_for_class(qosClass, nowait) != SUCCESS) {
+					break;
+				}
+				isLocked = true;
+				reservoir_close();
+			} else {
+				if (total > 0 && retval != -EFAULT) {
+					retval = total;
+				}
+				break;
+			}
+		} while (total < length);
+	#ifdef inDebugMode
+		if (total > length) {
+			printk(KERN_ALERT "Expected %d bytes to read and actually got %d \n", (int)length, (int)total);
+		}
+	#endif
+
+	}
+	isDeviceOpPending = false;
+	if (isLocked) {
+		reservoir_open();
+		mutex_unlock(&dataOpLock);
+	}
+	atomic_dec(&readersQueued);
+	return_qos_tokens(qosClass, length - total);
+	leave_op();
+	return retval;
+}
+
+/**
+ * Get the user space destination of the bytes following the ones already read
+ *
+ * @param char __user *buffer - pointer to the buffer in the user space, used when 'to' is NULL
+ * @param struct iov_iter *to - the destination buffers, NULL to copy to 'buffer'
+ * @param size_t offset - number of bytes already read
+ * @return char __user * - pointer into 'buffer', NULL when 'to' keeps the position itself
+ *
+ */
+static char __user *user_dest(char __user *buffer, struct iov_iter *to, size_t offset) {
+	if (to != NULL) {
+		return NULL;
+	}
+	return buffer + offset;
+}
+
+/**
+ * Fault in the destination of a read before a range is claimed, the copy itself runs with page faults disabled
+ *
+ * @param char __user *buffer - pointer to the buffer in the user space, used when 'to' is NULL
+ * @param struct iov_iter *to - the destination buffers, NULL to use 'buffer'
+ * @param size_t length - number of bytes to fault in
+ * @return true when at least the first byte can be written
+ *
+ */
+static bool prefault_user_bytes(char __user *buffer, struct iov_iter *to, size_t length) {
+	if (to != NULL) {
+		return fault_in_iov_iter_writeable(to, length) != length;
+	}
+	return fault_in_writeable(buffer, length) != length;
+}
+
+/**
+ * Copy a claimed range of the output buffer to user space with page faults disabled, so the copy
+ * never sleeps while a refill may be waiting for it
+ *
+ * @param char __user *buffer - pointer to the buffer in the user space, used when 'to' is NULL
+ * @param struct iov_iter *to - the destination buffers, NULL to copy to 'buffer'
+ * @param const uint8_t *src - the claimed bytes
+ * @param size_t length - number of claimed bytes
+ * @return size_t - number of bytes copied, less than 'length' when a destination page is not present
+ *
+ */
+static size_t copy_claimed_bytes(char __user *buffer, struct iov_iter *to, const uint8_t *src, size_t length) {
+	size_t copied;
+
+	pagefault_disable();
+	if (to != NULL) {
+		copied = copy_to_iter(src, length, to);
+	} else {
+		copied = length - copy_to_user(buffer, src, length);
+	}
+	pagefault_enable();
+	audit_handout(src, copied);
+	return copied;
+}
+
+/**
+ * Wait until the readers copying claimed ranges of the output buffer are done. Called with 'dataOpLock'
+ * held before the buffer bytes are moved or freed, no new range can be claimed meanwhile.
+ *
+ */
+static void wait_for_copies(void) {
+	wait_event(copiesDone, atomic_read(&copiesInFlight) == 0);
+}
+
+/**
+ * Read bytes already in the output buffer without taking 'dataOpLock'. A reader claims a range by
+ * advancing the reservoir word with one compare and swap, which fails once the lock holder has closed
+ * the reservoir by making the generation odd, so every byte is handed out once. The claimed range is
+ * copied before the reader leaves 'copiesInFlight', which the lock holder waits for before it moves
+ * the bytes. The caller has taken the rate limit tokens already, and while a critical reader waits for
+ * the lock the readers of the other classes queue up behind it as they would for the lock.
+ *
+ * @param int qosClass - the service class of the reader
+ * @param char __user *buffer - pointer to the buffer in the user space, used when 'to' is NULL
+ * @param struct iov_iter *to - the destination buffers, NULL to copy to 'buffer'
+ * @param size_t length - size in bytes for the read operation, faulted in by the caller
+ * @return 0 or greater - number of bytes read, otherwise the error code (a negative number)
+ *
+ */
+static ssize_t read_reservoir_bytes(int qosClass, char __user *buffer, struct iov_iter *to, size_t length) {
+	const int reserve = class_reserve_bytes(qosClass);
+	s64 word;
+	s64 claimed;
+	size_t act;
+	size_t copied = 0;
+	int avail;
+
+	if (length == 0 || (tl_reservoir_gen(atomic64_read(&outReservoir)) & 1)) {
+		// Nothing to read or the lock holder owns the bytes, the caller takes the lock
+		return 0;
+	}
+	if (IS_ENABLED(CONFIG_TLRANDOM_QOS) && qosClass != TLRANDOM_QOS_CRITICAL && atomic_read(&criticalWaiting) > 0) {
+		// Critical readers go first, lock_for_class() lets this one follow
+		return 0;
+	}
+
+	// Announced before the word is read, so a lock holder closing the reservoir either waits for this
+	// reader or makes its claim fail
+	atomic_inc(&copiesInFlight);
+	smp_mb__after_atomic();
+	word = atomic64_read(&outReservoir);
+	do {
+		avail = tl_reservoir_end(word) - tl_reservoir_idx(word) - reserve;
+		if ((tl_reservoir_gen(word) & 1) || avail <= 0) {
+			avail = 0;
+			break;
+		}
+		act = min(length, (size_t)avail);
+		claimed = tl_reservoir_word(tl_reservoir_gen(word), tl_reservoir_idx(word) + act, tl_reservoir_end(word));
+	} while (!atomic64_try_cmpxchg(&outReservoir, &word, claimed));
+
+	if (avail > 0) {
+		copied = copy_claimed_bytes(buffer, to, READ_ONCE(buffTRndOut) + tl_reservoir_idx(word), act);
+	}
+	if (atomic_dec_and_test(&copiesInFlight)) {
+		wake_up_all(&copiesDone);
+	}
+	if (avail == 0) {
+		return 0;
+	}
+
+	atomic64_add(act, &lockFreeDelivered[qosClass]);
+	if (READ_ONCE(outBufferNode) != NUMA_NO_NODE && numa_node_id() != READ_ONCE(outBufferNode)) {
+		atomic_long_add(act, &crossNodeReadBytes);
+	}
+	if (act == avail) {
+		// Drained, the next reader would have to refill
+		kick_refill();
+	}
+	return copied > 0 ? copied : -EFAULT;
+}
+
+/**
+ * Take 'curTrngOutIdx' and 'trngOutLen' over from the lock-free readers by making the generation odd,
+ * then wait for the ranges they claimed to be copied. Called with 'dataOpLock' held before the indexes
+ * are used, does nothing when the lock holder has closed the reservoir already.
+ *
+ */
+static void reservoir_close(void) {
+	s64 word = atomic64_read(&outReservoir);
+
+	do {
+		if (tl_reservoir_gen(word) & 1) {
+			return;
+		}
+	} while (!atomic64_try_cmpxchg(&outReservoir, &word, tl_reservoir_word(tl_reservoir_gen(word) + 1, tl_reservoir_idx(word), tl_reservoir_end(word))));
+	curTrngOutIdx = tl_reservoir_idx(word);
+	wait_for_copies();
+}
+
+/**
+ * Publish 'curTrngOutIdx' and 'trngOutLen' to the lock-free readers with the next even generation.
+ * Called with 'dataOpLock' held before it is released.
+ *
+ */
+static void reservoir_open(void) {
+	s64 word = atomic64_read(&outReservoir);
+
+	if (tl_reservoir_gen(word) & 1) {
+		// The bytes of a refill are written before the readers can see the new end
+		atomic64_set_release(&outReservoir, tl_reservoir_word(tl_reservoir_gen(word) + 1, curTrngOutIdx, trngOutLen));
+	}
+}
+
+/**
+ * Get the number of conditioned bytes not claimed yet
+ *
+ * @return int - number of bytes
+ *
+ */
+static int reservoir_unread(void) {
+	s64 word = atomic64_read(&outReservoir);
+
+	if (tl_reservoir_gen(word) & 1) {
+		// The lock holder owns the indexes
+		return READ_ONCE(trngOutLen) - READ_ONCE(curTrngOutIdx);
+	}
+	return tl_reservoir_end(word) - tl_reservoir_idx(word);
+}
+
+/**
+ * Get the number of bytes delivered to readers, with and without the lock and from the express pools
+ *
+ * @return unsigned long - number of bytes
+ *
+ */
+static unsigned long delivered_bytes(void) {
+	unsigned long delivered = deliveredBytes + express_delivered();
+	int i;
+
+	for (i = 0; i < TLRANDOM_QOS_CLASSES; i++) {
+		delivered += atomic64_read(&lockFreeDelivered[i]);
+	}
+	return delivered;
+}
+
+/**
+ * Record the anchors of bytes handed out to a reader when the audit mode is on. Costs a not taken
+ * branch when it is off. The audit lock is taken for one chunk of the bytes at a time.
+ *
+ * @param const uint8_t *src - the handed out bytes
+ * @param size_t length - number of bytes
+ *
+ */
+static void audit_handout(const uint8_t *src, size_t length) {
+	struct audit_state *st;
+	size_t chunkEnd;
+	size_t i;
+	u64 window;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_AUDIT) || !static_branch_unlikely(&auditEnabled)) {
+		return;
+	}
+	st = READ_ONCE(auditState);
+	if (st == NULL || length < sizeof(window)) {
+		return;
+	}
+	for (i = 0; i <= length - sizeof(window); ) {
+		chunkEnd = min(i + AUDIT_CHUNK_BYTES, length - sizeof(window) + 1);
+		spin_lock(&st->lock);
+		for (; i < chunkEnd; i++) {
+			window = get_unaligned_le64(src + i);
+			if ((window & AUDIT_ANCHOR_MASK) == 0 && window != 0) {
+				audit_anchor(st, window);
+			}
+		}
+		spin_unlock(&st->lock);
+	}
+}
+
+/**
+ * Look an anchor up in the bloom filters and add it. A hit is confirmed in the hash table of the
+ * latest anchors before it is reported as a duplicate. Called with the audit lock held.
+ *
+ * @param struct audit_state *st - the audit state
+ * @param u64 anchor - anchor of the handed out bytes
+ *
+ */
+static void audit_anchor(struct audit_state *st, u64 anchor) {
+	struct audit_anchor *recent;
+	u32 bits[AUDIT_BLOOM_HASHES];
+	bool isSeen[2] = { true, true };
+	int h;
+
+	for (h = 0; h < AUDIT_BLOOM_HASHES; h++) {
+		bits[h] = hash_64(anchor ^ (0x9E3779B97F4A7C15ULL * (h + 1)), AUDIT_BLOOM_ORDER);
+		isSeen[0] = isSeen[0] && test_bit(bits[h], st->bloom[0]);
+		isSeen[1] = isSeen[1] && test_bit(bits[h], st->bloom[1]);
+	}
+	if (isSeen[0] || isSeen[1]) {
+		st->bloomHits++;
+		hash_for_each_possible(st->recentTable, recent, node, anchor) {
+			if (recent->value == anchor) {
+				st->duplicates++;
+				printk_ratelimited(KERN_ALERT "Audit: output bytes %016llx were handed out twice\n", anchor);
+				break;
+			}
+		}
+	}
+
+	if (st->bloomCount == AUDIT_BLOOM_ANCHORS) {
+		// The current filter is full, the older one starts over
+		st->bloomCur ^= 1;
+		bitmap_zero(st->bloom[st->bloomCur], AUDIT_BLOOM_BITS);
+		st->bloomCount = 0;
+	}
+	for (h = 0; h < AUDIT_BLOOM_HASHES; h++) {
+		__set_bit(bits[h], st->bloom[st->bloomCur]);
+	}
+	st->bloomCount++;
+
+	// The oldest anchor makes room for this one
+	recent = &st->recent[st->recentIdx];
+	if (!hlist_unhashed(&recent->node)) {
+		hash_del(&recent->node);
+	}
+	recent->value = anchor;
+	hash_add(st->recentTable, &recent->node, anchor);
+	st->recentIdx = (st->recentIdx + 1) % AUDIT_RECENT_ANCHORS;
+	st->anchors++;
+}
+
+/**
+ * Forget the bytes handed out so far, they are expected again when a recording is replayed
+ *
+ */
+static void audit_reset(void) {
+	struct audit_state *st = READ_ONCE(auditState);
+
+	if (st == NULL) {
+		return;
+	}
+	spin_lock(&st->lock);
+	bitmap_zero(st->bloom[0], AUDIT_BLOOM_BITS);
+	bitmap_zero(st->bloom[1], AUDIT_BLOOM_BITS);
+	memset(st->recent, 0, sizeof(st->recent));
+	hash_init(st->recentTable);
+	st->bloomCount = 0;
+	st->recentIdx = 0;
+	spin_unlock(&st->lock);
+}
+
+/**
+ * Turn the audit mode on or off. The audit state is allocated when the mode is first turned on and kept
+ * until the module is removed, so a reader never sees it go away. Called with 'dataOpLock' held.
+ *
+ * @param int mode - 1 to audit the handed out bytes, 0 to stop
+ * @return 0 - success, otherwise the error code (a negative number)
+ *
+ */
+static int apply_audit_mode(int mode) {
+	struct audit_state *st;
+
+	if (mode == 1 && auditState == NULL) {
+		st = kvzalloc(sizeof(*st), GFP_KERNEL);
+		if (st == NULL) {
+			printk(KERN_ALERT "Could not allocate %d kernel bytes for the audit mode\n", (int)sizeof(*st));
+			return -ENOMEM;
+		}
+		spin_lock_init(&st->lock);
+		WRITE_ONCE(auditState, st);
+	}
+	auditMode = mode;
+	if (mode == 1) {
+		static_branch_enable(&auditEnabled);
+	} else {
+		static_branch_disable(&auditEnabled);
+	}
+	return SUCCESS;
+}
+
+#ifdef CONFIG_TLRANDOM_AUDIT
+static int set_audit_mode(const char *val, const struct kernel_param *kp) {
+	int mode;
+	int retval;
+
+	retval = kstrtoint(val, 0, &mode);
+	if (retval) {
+		return retval;
+	}
+	if (mode < 0 || mode > 1) {
+		return -EINVAL;
+	}
+
+	if (!isOutBufferRdy) {
+		// Set when loading the module, applied once the module is initialized
+		auditMode = mode;
+		return SUCCESS;
+	}
+
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		return -EINTR;
+	}
+	retval = apply_audit_mode(mode);
+	mutex_unlock(&dataOpLock);
+	return retval;
+}
+#endif
+
+/**
+ * Take the rate limit tokens for a read. Every class has a token bucket filled at 'qos_rate_bytes'
+ * bytes per second and holding at most one second worth of tokens.
+ *
+ * @param int qosClass - the service class of the reader
+ * @param size_t length - size in bytes for the read operation
+ * @param bool nowait - fail instead of waiting for the bucket to fill
+ * @return greater than 0 - number of bytes the reader may read, otherwise the error code (a negative number)
+ *
+ */
+static ssize_t take_qos_tokens(int qosClass, size_t length, bool nowait) {
+	struct qos_bucket *bucket = &qosBuckets[qosClass];
+	unsigned long added;
+	unsigned long rate;
+	size_t granted;
+	ktime_t now;
+	s64 elapsedNs;
+	bool isThrottled = false;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_QOS)) {
+		return length;
+	}
+	for (;;) {
+		rate = max(READ_ONCE(qosRateBytes[qosClass]), 0);
+		if (rate == 0 || length == 0) {
+			return length;
+		}
+
+		spin_lock(&qosLock);
+		now = ktime_get();
+		elapsedNs = min_t(s64, ktime_to_ns(ktime_sub(now, bucket->lastFill)), NSEC_PER_SEC);
+		added = (unsigned long)div_u64((u64)rate * elapsedNs, NSEC_PER_SEC);
+		if (added > 0) {
+			// A fraction of a token stays with the next call
+			bucket->tokens = min(bucket->tokens + added, rate);
+			bucket->lastFill = now;
+		}
+		granted = min(length, (size_t)bucket->tokens);
+		bucket->tokens -= granted;
+		if (granted == 0 && !isThrottled) {
+			isThrottled = true;
+			qosThrottled[qosClass]++;
+		}
+		spin_unlock(&qosLock);
+
+		if (granted > 0) {
+			return granted;
+		}
+		if (nowait) {
+			return -EAGAIN;
+		}
+		// Sleep about as long as one byte takes to come in, never longer than a tick of the demand sampling
+		schedule_timeout_killable(msecs_to_jiffies(clamp_t(unsigned long, MSEC_PER_SEC / rate, 1, DEMAND_SAMPLE_MSECS)));
+		if (fatal_signal_pending(current) || isShutDown) {
+			return -EINTR;
+		}
+	}
+}
+
+/**
+ * Give back the tokens of the bytes a reader was allowed to read but did not get
+ *
+ * @param int qosClass - the service class of the reader
+ * @param size_t length - number of bytes not read
+ *
+ */
+static void return_qos_tokens(int qosClass, size_t length) {
+	unsigned long rate = max(READ_ONCE(qosRateBytes[qosClass]), 0);
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_QOS) || rate == 0 || length == 0) {
+		return;
+	}
+	spin_lock(&qosLock);
+	qosBuckets[qosClass].tokens = min(qosBuckets[qosClass].tokens + length, rate);
+	spin_unlock(&qosLock);
+}
+
+/**
+ * Take 'dataOpLock' for a reader. Critical readers go first, the others wait until no critical reader
+ * is queued for the lock.
+ *
+ * @param int qosClass - the service class of the reader
+ * @param bool nowait - fail instead of waiting for the lock
+ * @return 0 - the lock is taken, otherwise the error code (a negative number)
+ *
+ */
+static int lock_for_class(int qosClass, bool nowait) {
+	int retval;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_QOS)) {
+		// Built without service classes, every reader takes the lock the same way
+		retval = nowait ? (mutex_trylock(&dataOpLock) ? SUCCESS : -EAGAIN) : mutex_lock_killable(&dataOpLock);
+	} else if (qosClass == TLRANDOM_QOS_CRITICAL) {
+		atomic_inc(&criticalWaiting);
+		if (nowait) {
+			retval = mutex_trylock(&dataOpLock) ? SUCCESS : -EAGAIN;
+		} else {
+			retval = mutex_lock_killable(&dataOpLock);
+		}
+		if (atomic_dec_and_test(&criticalWaiting)) {
+			wake_up_all(&qosWait);
+		}
+	} else if (nowait) {
+		// A refill or a critical reader is running, poll reports when it is done
+		retval = (atomic_read(&criticalWaiting) == 0 && mutex_trylock(&dataOpLock)) ? SUCCESS : -EAGAIN;
+	} else {
+		for (;;) {
+			retval = wait_event_killable(qosWait, atomic_read(&criticalWaiting) == 0);
+			if (retval != SUCCESS) {
+				break;
+			}
+			retval = mutex_lock_killable(&dataOpLock);
+			if (retval != SUCCESS || atomic_read(&criticalWaiting) == 0) {
+				break;
+			}
+			// A critical reader queued up while this one waited for the lock
+			mutex_unlock(&dataOpLock);
+		}
+	}
+
+	if (retval != SUCCESS && retval != -EAGAIN) {
+		printk(KERN_ALERT "Could not lock the mutex\n");
+		retval = -EPERM;
+	}
+	return retval;
+}
+
+/**
+ * Get the number of output buffer bytes a service class leaves to the others. Bulk readers stay above
+ * the 'bulk_watermark_bytes' module parameter, there is always room for one block of output above it.
+ *
+ * @param int qosClass - the service class of the reader
+ * @return int - number of bytes that class may not read
+ *
+ */
+static int class_reserve_bytes(int qosClass) {
+	if (!IS_ENABLED(CONFIG_TLRANDOM_QOS) || qosClass != TLRANDOM_QOS_BULK) {
+		return 0;
+	}
+	return clamp(bulkWatermarkBytes, 0, outBufferBytes - MIN_OUT_BUFFER_BYTES);
+}
+
+/**
+ * Get the service class of an open file, always the normal class when the module is built without them
+ *
+ * @param struct reader_ctx *ctx - the reader context of the open file
+ * @return int - the service class
+ *
+ */
+static int reader_qos_class(struct reader_ctx *ctx) {
+	return IS_ENABLED(CONFIG_TLRANDOM_QOS) ? READ_ONCE(ctx->qosClass) : TLRANDOM_QOS_NORMAL;
+}
+
+/**
+ * Serve a short read from the express pool of the node the reader runs on. The bytes are taken under
+ * a spinlock and copied to user space after it is released, so a short read never waits for a refill
+ * running under 'dataOpLock'.
+ *
+ * @param char __user *buffer - pointer to the buffer in the user space, used when 'to' is NULL
+ * @param struct iov_iter *to - the destination buffers, NULL to copy to 'buffer'
+ * @param size_t length - size in bytes for the read operation
+ * @return greater than 0 - number of bytes read, 0 - not served by the pool, otherwise the error code (a negative number)
+ *
+ */
+static ssize_t read_express_bytes(char __user *buffer, struct iov_iter *to, size_t length) {
+	uint8_t bytes[EXPRESS_MAX_READ_BYTES];
+	struct express_pool *pool;
+	bool isLow;
+	bool isFault;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_EXPRESS) || length == 0 || length > min(READ_ONCE(expressMaxBytes), EXPRESS_MAX_READ_BYTES)) {
+		return 0;
+	}
+	pool = expressPools[numa_node_id()];
+	if (pool == NULL) {
+		// A node brought online after the module was loaded
+		return 0;
+	}
+
+	spin_lock(&pool->lock);
+	if (pool->len - pool->idx < length) {
+		pool->misses++;
+		spin_unlock(&pool->lock);
+		kick_refill();
+		return 0;
+	}
+	memcpy(bytes, pool->bytes + pool->idx, length);
+	memzero_explicit(pool->bytes + pool->idx, length);
+	pool->idx += length;
+	pool->hits++;
+	pool->delivered += length;
+	isLow = pool->len - pool->idx < EXPRESS_POOL_BYTES / 2;
+	spin_unlock(&pool->lock);
+	audit_handout(bytes, length);
+
+	if (isLow) {
+		kick_refill();
+	}
+
+	if (to != NULL) {
+		isFault = copy_to_iter(bytes, length, to) != length;
+	} else {
+		isFault = copy_to_user(buffer, bytes, length) != 0;
+	}
+	memzero_explicit(bytes, length);
+	return isFault ? -EFAULT : length;
+}
+
+/**
+ * Move conditioned bytes into the express pools, each pool takes what it is missing in node order.
+ * Called with 'dataOpLock' held.
+ *
+ * @param const uint8_t *src - the conditioned bytes, they passed the health tests
+ * @param int length - number of bytes available
+ * @return int - number of bytes taken
+ *
+ */
+static int fill_express(const uint8_t *src, int length) {
+	struct express_pool *pool;
+	int node;
+	int taken;
+	int total = 0;
+
+	for_each_online_node(node) {
+		pool = expressPools[node];
+		if (pool == NULL) {
+			continue;
+		}
+		spin_lock(&pool->lock);
+		if (pool->idx > 0) {
+			memmove(pool->bytes, pool->bytes + pool->idx, pool->len - pool->idx);
+			pool->len -= pool->idx;
+			pool->idx = 0;
+		}
+		taken = clamp(length - total, 0, EXPRESS_POOL_BYTES - pool->len);
+		memcpy(pool->bytes + pool->len, src + total, taken);
+		pool->len += taken;
+		if (taken > 0) {
+			pool->fills++;
+		}
+		spin_unlock(&pool->lock);
+		if (node != numa_node_id()) {
+			crossNodeFillBytes += taken;
+		}
+		total += taken;
+	}
+	return total;
+}
+
+/**
+ * Get the number of bytes the express pools are missing when one of them is below half full
+ *
+ * @return int - number of bytes to fill all the pools, 0 when each pool is at least half full or the pools are disabled
+ *
+ */
+static int express_deficit(void) {
+	struct express_pool *pool;
+	int node;
+	int avail;
+	int missing = 0;
+	bool isLow = false;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_EXPRESS) || READ_ONCE(expressMaxBytes) <= 0) {
+		return 0;
+	}
+	for_each_online_node(node) {
+		pool = expressPools[node];
+		if (pool == NULL) {
+			continue;
+		}
+		spin_lock(&pool->lock);
+		avail = pool->len - pool->idx;
+		spin_unlock(&pool->lock);
+		missing += EXPRESS_POOL_BYTES - avail;
+		isLow |= avail < EXPRESS_POOL_BYTES / 2;
+	}
+	return isLow ? missing : 0;
+}
+
+/**
+ * Discard the bytes of all the express pools
+ *
+ */
+static void clear_express(void) {
+	struct express_pool *pool;
+	int node;
+
+	for_each_online_node(node) {
+		pool = expressPools[node];
+		if (pool == NULL) {
+			continue;
+		}
+		spin_lock(&pool->lock);
+		memzero_explicit(pool->bytes, sizeof(pool->bytes));
+		pool->len = 0;
+		pool->idx = 0;
+		spin_unlock(&pool->lock);
+	}
+}
+
+/**
+ * Get the number of bytes delivered from all the express pools
+ *
+ * @return unsigned long - number of bytes
+ *
+ */
+static unsigned long express_delivered(void) {
+	unsigned long delivered = 0;
+	int node;
+
+	for_each_online_node(node) {
+		if (expressPools[node] != NULL) {
+			delivered += READ_ONCE(expressPools[node]->delivered);
+		}
+	}
+	return delivered;
+}
+
+/**
+ * Allocate an express pool on every online NUMA node
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int alloc_express_pools(void) {
+	struct express_pool *pool;
+	int node;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_EXPRESS)) {
+		return SUCCESS;
+	}
+	for_each_online_node(node) {
+		pool = kzalloc_node(sizeof(*pool), GFP_KERNEL, node);
+		if (pool == NULL) {
+			printk(KERN_ALERT "Could not allocate the express pool of node %d\n", node);
+			free_express_pools();
+			return -ENOMEM;
+		}
+		spin_lock_init(&pool->lock);
+		expressPools[node] = pool;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Free the express pools
+ *
+ */
+static void free_express_pools(void) {
+	int node;
+
+	for (node = 0; node < MAX_NUMNODES; node++) {
+		kfree_sensitive(expressPools[node]);
+		expressPools[node] = NULL;
+	}
+}
+
+/**
+ * Check if the output buffer holds conditioned bytes not read yet. They passed the health tests,
+ * so they are served even when the device is gone.
+ *
+ * @return true when there are unread bytes
+ *
+ */
+static bool has_reservoir_bytes(void) {
+	return reservoir_unread() > 0;
+}
+
+/**
+ * Check if a device was unplugged recently enough to wait for it to come back
+ *
+ * @return true when a device is expected to be plugged in again
+ *
+ */
+static bool is_replug_expected(void) {
+	if (isStartupPending && !isShutDown) {
+		// Plugged in and starting
+		return true;
+	}
+	return isDeviceGone && !isShutDown && ktime_before(ktime_get(), ktime_add_ms(disconnectTime, max(replugWaitMsecs, 0)));
+}
+
+/**
+ * Wait for an unplugged device to come back, for no longer than 'replug_wait_ms' after it was
+ * unplugged. Called with 'dataOpLock' held, the lock is released while waiting.
+ *
+ * @return 0 - the device is back, otherwise the error code (a negative number)
+ *
+ */
+static int wait_for_device(void) {
+	long left;
+	long timeout;
+	s64 waitMsecs;
+
+	if (!is_replug_expected()) {
+		return -ENODATA;
+	}
+	if (isStartupPending) {
+		// The startup ends with the device ready or failed, its transfers have timeouts of their own
+		timeout = MAX_SCHEDULE_TIMEOUT;
+	} else {
+		waitMsecs = ktime_ms_delta(ktime_add_ms(disconnectTime, replugWaitMsecs), ktime_get());
+		timeout = msecs_to_jiffies(max_t(s64, waitMsecs, 1));
+		replugWaitCount++;
+	}
+
+	reservoir_open();
+	mutex_unlock(&dataOpLock);
+	left = wait_event_killable_timeout(deviceWait, is_entropy_src_rdy() || !is_replug_expected(), timeout);
+	mutex_lock(&dataOpLock);
+	reservoir_close();
+
+	if (left < 0) {
+		return -EINTR;
+	}
+	// A device still starting is waited for again by the caller
+	return is_entropy_src_rdy() || isStartupPending ? SUCCESS : -ENODATA;
+}
+
+/**
+ * Register a reader or a background refill, fails once the module is being unloaded
+ *
+ * @return true when the operation may proceed
+ *
+ */
+static bool enter_op(void) {
+	return atomic_inc_not_zero(&pendingOps);
+}
+
+/**
+ * Unregister a reader or a background refill, the last one out wakes up the module unloading
+ *
+ */
+static void leave_op(void) {
+	if (atomic_dec_and_test(&pendingOps)) {
+		complete(&pendingOpsDone);
+	}
+}
+
+/**
+ * Account a read request in the consumer demand statistics
+ *
+ * @param size_t length - size in bytes of the read request
+ *
+ */
+static void track_demand(size_t length) {
+	ktime_t now = ktime_get();
+	s64 elapsedMsecs;
+
+	avgReadSize = avgReadSize ? (avgReadSize * 7 + length) / 8 : length;
+	// Reads served without the lock count towards the demand too
+	demandSampleBytes += length + atomic_long_xchg(&lockFreeDemandBytes, 0);
+	elapsedMsecs = ktime_ms_delta(now, demandSampleStart);
+	if (elapsedMsecs >= DEMAND_SAMPLE_MSECS) {
+		// A long idle period makes a single low sample, so the rate decays quickly
+		demandRate = (demandRate * 3 + demandSampleBytes * MSEC_PER_SEC / elapsedMsecs) / 4;
+		demandSampleBytes = 0;
+		demandSampleStart = now;
+	}
+}
+
+/**
+ * Choose how many raw bytes to request from the device with the next refill. The size covers the
+ * reader holding the lock, the readers queued behind it and the measured demand rate, bounded by the
+ * 'min_xfer_bytes' module parameter and the free room in the output buffer.
+ *
+ * @param int room - free bytes in the output buffer, at least one block of output
+ * @return int - number of raw bytes, a multiple of the conditioning block input size
+ *
+ */
+static int choose_xfer_bytes(int room) {
+	const int blockBytes = cond_block_bytes();
+	const int outBlockBytes = OUT_NUM_WORDS * WORD_SIZE_BYTES;
+	unsigned long want;
+	int queued;
+	int lo, hi;
+
+	queued = atomic_read(&readersQueued) - 1;
+	want = readPending;
+	if (queued > 0) {
+		want += queued * avgReadSize;
+	}
+	want = max(want, demandRate * demandWindowMsecs / MSEC_PER_SEC);
+
+	// Conditioned bytes wanted to raw bytes, no more than the output buffer has room for
+	hi = room / outBlockBytes * blockBytes;
+	want = min(DIV_ROUND_UP(want, outBlockBytes), (unsigned long)hi) * blockBytes;
+
+	lo = clamp(roundup(model_default(minXferBytes, devModel->minXferBytes), blockBytes), blockBytes, hi);
+	return (int)clamp(want, (unsigned long)lo, (unsigned long)hi);
+}
+
+#ifndef CONFIG_TLRANDOM_OUT_BUFFER_BYTES
+/**
+ * Change the output buffer size, a handler for writing the 'out_buffer_bytes' module parameter
+ *
+ * @param const char *val - the new size in bytes
+ * @param const struct kernel_param *kp - the parameter
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int set_out_buffer_bytes(const char *val, const struct kernel_param *kp) {
+	int size;
+	int retval;
+
+	retval = kstrtoint(val, 0, &size);
+	if (retval) {
+		return retval;
+	}
+	if (size < MIN_OUT_BUFFER_BYTES || size > MAX_OUT_BUFFER_BYTES) {
+		return -EINVAL;
+	}
+	size = rounddown(size, MIN_OUT_BUFFER_BYTES);
+
+	if (!isOutBufferRdy) {
+		// Set when loading the module, the buffer is allocated later
+		outBufferBytes = size;
+		return SUCCESS;
+	}
+
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		return -EINTR;
+	}
+	if (isOutBufferRdy) {
+		retval = resize_out_buffer(size, outBufferNode);
+	} else {
+		outBufferBytes = size;
+	}
+	mutex_unlock(&dataOpLock);
+	return retval;
+}
+#endif
+
+/**
+ * Replace the output buffer, keeping as many of the unread bytes as fit. Large buffers are backed by
+ * pages mapped with vmalloc rather than one physically contiguous block. Called with 'dataOpLock' held.
+ *
+ * @param int size - the new size in bytes
+ * @param int node - the NUMA node to allocate on, NUMA_NO_NODE for any
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int resize_out_buffer(int size, int node) {
+	uint8_t *buff;
+	int unread;
+
+	buff = kvmalloc_node(size, GFP_KERNEL, node);
+	if (buff == NULL) {
+		printk(KERN_ALERT "Could not allocate %d kernel bytes for the random output buffer\n", size);
+		return -ENOMEM;
+	}
+
+	unread = 0;
+	reservoir_close();
+	if (buffTRndOut != NULL) {
+		unread = min(trngOutLen - curTrngOutIdx, size);
+		if (unread > 0) {
+			memcpy(buff, buffTRndOut + curTrngOutIdx, unread);
+		} else {
+			unread = 0;
+		}
+		// The old buffer holds output that was never handed out
+		kvfree_sensitive(buffTRndOut, outBufferBytes);
+	}
+	buffTRndOut = buff;
+	trngOutLen = unread;
+	curTrngOutIdx = 0;
+#ifndef CONFIG_TLRANDOM_OUT_BUFFER_BYTES
+	outBufferBytes = size;
+#endif
+	outBufferNode = node;
+	reservoir_open();
+	return SUCCESS;
+}
+
+/**
+ * Get the largest number of raw bytes requested from the device with one command
+ *
+ * @return int - number of raw bytes, a multiple of the conditioning block input size
+ *
+ */
+static int max_cmd_bytes(void) {
+	const int blockBytes = cond_block_bytes();
+
+	// The byte count of a command is 16 bits wide
+	return max(rounddown(min(model_default(maxXferBytes, devModel->maxXferBytes), 0xffff), blockBytes), blockBytes);
+}
+
+/**
+ * Get the number of raw bytes the conditioning profile hashes into one output block
+ *
+ * @return int - number of raw bytes
+ *
+ */
+static int cond_block_bytes(void) {
+	return condProfiles[condProfile].blockWords * WORD_SIZE_BYTES;
+}
+
+/**
+ * Get the entropy of the conditioned output declared by the conditioning profile
+ *
+ * @return int - min-entropy per 1000 output bits
+ *
+ */
+static int cond_entropy_per_mille(void) {
+	return tl_cond_entropyPerMille(condProfiles[condProfile].blockWords, entropyPerMille);
+}
+
+/**
+ * Check if the module is built with a conditioning profile, a fixed profile is the only one available
+ *
+ * @param uint32_t profile - the profile number
+ * @return true when the profile can be used
+ *
+ */
+static bool is_cond_profile_built(uint32_t profile) {
+#ifdef CONFIG_TLRANDOM_COND_PROFILE
+	return profile == CONFIG_TLRANDOM_COND_PROFILE;
+#else
+	return profile < ARRAY_SIZE(condProfiles);
+#endif
+}
+
+/**
+ * Get the entropy of the conditioned output in the units of the hwrng 'quality' field
+ *
+ * @return int - min-entropy per 1024 output bits
+ *
+ */
+static int cond_quality(void) {
+	return cond_entropy_per_mille() * 1024 / 1000;
+}
+
+/**
+ * Change the assumed raw entropy, a handler for writing the 'raw_entropy_per_mille' module parameter.
+ * The hwrng framework gets the new quality.
+ *
+ * @param const char *val - the entropy per 1000 raw bits
+ * @param const struct kernel_param *kp - the parameter
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int set_entropy_per_mille(const char *val, const struct kernel_param *kp) {
+	int value;
+	int retval;
+
+	retval = kstrtoint(val, 0, &value);
+	if (retval) {
+		return retval;
+	}
+	if (value < 0 || value > 1000) {
+		return -EINVAL;
+	}
+	WRITE_ONCE(entropyPerMille, value);
+	if (isOutBufferRdy) {
+		update_hwrng();
+	}
+	return SUCCESS;
+}
+
+#ifndef CONFIG_TLRANDOM_COND_PROFILE
+/**
+ * Change the conditioning profile, a handler for writing the 'cond_profile' module parameter.
+ * Bytes conditioned with the previous profile are discarded, so the declared entropy always holds.
+ *
+ * @param const char *val - the profile number
+ * @param const struct kernel_param *kp - the parameter
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int set_cond_profile(const char *val, const struct kernel_param *kp) {
+	int profile;
+	int retval;
+
+	retval = kstrtoint(val, 0, &profile);
+	if (retval) {
+		return retval;
+	}
+	if (profile < 0 || profile >= (int)ARRAY_SIZE(condProfiles)) {
+		return -EINVAL;
+	}
+
+	if (!isOutBufferRdy) {
+		// Set when loading the module, nothing is conditioned yet
+		condProfile = profile;
+		return SUCCESS;
+	}
+
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		return -EINTR;
+	}
+	if (is_replaying()) {
+		// The recording decides the profile of a replay
+		retval = -EBUSY;
+	} else if (profile != condProfile) {
+		reservoir_close();
+		condProfile = profile;
+		memzero_explicit(buffTRndOut + curTrngOutIdx, trngOutLen - curTrngOutIdx);
+		trngOutLen = 0;
+		curTrngOutIdx = 0;
+		reservoir_open();
+		clear_express();
+	}
+	mutex_unlock(&dataOpLock);
+	if (retval == SUCCESS) {
+		update_hwrng();
+	}
+	return retval;
+}
+#endif
+
+/**
+ * A function to request new entropy bytes when running out of entropy in the local buffer
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int get_entropy_bytes(void) {
+	return refill_below(0);
+}
+
+/**
+ * Top up the output buffer when no more than 'level' unread bytes are left in it
+ *
+ * @param int level - number of unread bytes that still calls for a refill
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int refill_below(int level) {
+	int status;
+	if(trngOutLen - curTrngOutIdx <= level) {
+		status = rcv_rnd_bytes();
+	} else {
+		status = SUCCESS;
+	}
+	return status;
+}
+
+/**
+ * A function to fill the buffer with new entropy bytes, placed after the bytes not read yet
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int rcv_rnd_bytes(void) {
+	int retval;
+   	int byteCnt;
+   	int refillBytes;
+   	int outLen;
+   	int cmdOutLen;
+   	int unread;
+   	int expressBytes;
+   	int taken;
+   	struct tl_device *dev;
+
+	// The startup refills run before the device is announced ready
+	if (isShutDown || (!isEntropySrcRdy && !is_replaying())) {
+		return -EPERM;
+	}
+
+	// Unread bytes kept for the other service classes move to the front, the refill goes after them
+	reservoir_close();
+	unread = max(trngOutLen - curTrngOutIdx, 0);
+	if (unread > 0 && curTrngOutIdx > 0) {
+		memmove(buffTRndOut, buffTRndOut + curTrngOutIdx, unread);
+	}
+	trngOutLen = unread;
+	curTrngOutIdx = 0;
+	if (outBufferBytes - unread < MIN_OUT_BUFFER_BYTES) {
+		return SUCCESS;
+	}
+
+	isUsbOpPending = true;
+	if (outBufferNode != NUMA_NO_NODE && numa_node_id() != outBufferNode) {
+		// A reader on another node refills in its own context, not on the producer node
+		crossNodeRefills++;
+	}
+
+	// A replayed session requests the same sizes as the recorded one, one command per refill
+	refillBytes = is_replaying() ? traffic_replay_xfer_bytes(outBufferBytes - unread) : 0;
+	if (refillBytes == 0) {
+		refillBytes = choose_xfer_bytes(outBufferBytes - unread);
+	}
+	lastXferBytes = refillBytes;
+
+	dev = NULL;
+	if (!is_replaying()) {
+		dev = tlDev;
+		kref_get(&dev->kref);
+		retval = wake_device();
+		if (retval != SUCCESS) {
+			kref_put(&dev->kref, tl_device_release);
+			isUsbOpPending = false;
+			return retval;
+		}
+	}
+
+	// Nothing new is available until this refill passes the health tests
+	retval = SUCCESS;
+	outLen = unread;
+	while (retval == SUCCESS && refillBytes > 0) {
+		byteCnt = min(refillBytes, max_cmd_bytes());
+		// Output of the startup test is not handed out, the startup fills the express pools when done
+		expressBytes = dev != NULL && !isStartupPending ? express_deficit() : 0;
+		if (expressBytes > 0) {
+			// A low express pool gets a short command of its own ahead of the bulk of the refill
+			byteCnt = min(byteCnt, DIV_ROUND_UP(expressBytes, OUT_NUM_WORDS * WORD_SIZE_BYTES) * cond_block_bytes());
+		}
+		retval = rcv_cmd_bytes(byteCnt, buffTRndOut + outLen, &cmdOutLen);
+		if (retval == SUCCESS && expressBytes > 0) {
+			// The express pool takes its share first, the rest stays in the output buffer
+			taken = fill_express(buffTRndOut + outLen, min(expressBytes, cmdOutLen));
+			cmdOutLen -= taken;
+			memmove(buffTRndOut + outLen, buffTRndOut + outLen + taken, cmdOutLen);
+		}
+		outLen += cmdOutLen;
+		refillBytes -= byteCnt;
+		refillCount++;
+	}
+
+	if (dev != NULL) {
+		usb_mark_last_busy(dev->usb.udev);
+		usb_autopm_put_interface(dev->usb.interface);
+		kref_put(&dev->kref, tl_device_release);
+	}
+	if (retval == SUCCESS) {
+		trngOutLen = outLen;
+		wake_up_interruptible_poll(&readWait, EPOLLIN | EPOLLRDNORM);
+	}
+
+	isUsbOpPending = false;
+	return retval;
+}
+
+/**
+ * Request raw bytes from the device with one command, condition them and run the health tests
+ *
+ * @param int byteCnt - number of raw bytes, a multiple of the conditioning block input size
+ * @param uint8_t *dst - where the conditioned bytes go
+ * @param int *outLen - set to the number of conditioned bytes
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int rcv_cmd_bytes(int byteCnt, uint8_t *dst, int *outLen) {
+	int retval;
+	char *cmd;
+
+	*outLen = 0;
+
+	// The command is never sent to a device while replaying
+	cmd = is_replaying() ? replayCmdBuff : usbData->bulk_out_buffer;
+   	cmd[0] = 'x';
+	cmd[1] = byteCnt & 0x00ff;
+	cmd[2] = byteCnt >> 8;
+
+	// The raw bytes are conditioned as they arrive, straight into the output buffer
+	tl_cond_streamStart(&condStream, &shaData, IS_ENABLED(CONFIG_TLRANDOM_COND_HMAC) && condProfiles[condProfile].isHmac ? &hmacData : NULL,
+			condProfiles[condProfile].blockWords, byteCnt, (uint32_t *)dst);
+	if (isRawTestPending) {
+		tl_cond_streamTestRaw(&condStream, &rawRctData, &rawAptData);
+	}
+	retval = transact(cmd, 3, NULL, &condStream, byteCnt, USB_READ_TIMEOUT_SECS);
+	if (retval != SUCCESS) {
+		// Serial numbers are only used up by a complete response
+		tl_cond_streamRestart(&condStream);
+		return retval;
+	}
+
+	tl_rct_restart(&rctData);
+	tl_apt_restart(&aptData);
+	*outLen = condStream.outWords * WORD_SIZE_BYTES;
+	traffic_record_output(dst, *outLen);
+	tl_health_sampleBuffer(&rctData, &aptData, dst, *outLen);
+
+	if (rctData.statusByte != SUCCESS) {
+		printk(KERN_ALERT "Repetition Count Test failure\n");
+		retval = -EPERM;
+	} else if (aptData.statusByte != SUCCESS) {
+		printk(KERN_ALERT "Adaptive Proportion Test failure\n");
+		retval = -EPERM;
+	}
+	return retval;
+}
+
+/**
+ * Take a runtime PM reference on the device, resuming it when suspended
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int wake_device(void) {
+	ktime_t start;
+	bool wasSuspended;
+	s64 wakeUs;
+	int retval;
+
+	wasSuspended = isDevSuspended;
+	start = ktime_get();
+	isRefillWaking = true;
+	retval = usb_autopm_get_interface(usbData->interface);
+	isRefillWaking = false;
+	if (retval) {
+		printk(KERN_ALERT "Could not resume the USB device, error %d\n", retval);
+		return retval;
+	}
+	if (wasSuspended) {
+		wakeUs = ktime_us_delta(ktime_get(), start);
+		wakeCount++;
+		wakeUsLast = wakeUs;
+		wakeUsMax = max(wakeUsMax, wakeUs);
+		wakeUsTotal += wakeUs;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Send a TL device command and receive response
+ *
+ * @param char *snd -  a pointer to the command
+ * @param int sizeSnd - how many bytes in command
+ * @param char *rcv - a pointer to the data receive buffer
+ * @param int sizeRcv - how many bytes expected to receive
+ * @param int opTimeoutSecs - device read time out value in seconds
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int snd_rcv_usb_data(char *snd, int sizeSnd, char *rcv, int sizeRcv, int opTimeoutSecs) {
+	return transact(snd, sizeSnd, rcv, NULL, sizeRcv, opTimeoutSecs);
+}
+
+/**
+ * Send a TL device command and receive response, either into a buffer or conditioned on the fly
+ *
+ * @param char *snd -  a pointer to the command
+ * @param int sizeSnd - how many bytes in command
+ * @param char *rcv - a pointer to the data receive buffer, not used with a stream
+ * @param struct tl_cond_stream *cs - a conditioning stream for the data, NULL to receive into 'rcv'
+ * @param int sizeRcv - how many bytes expected to receive
+ * @param int opTimeoutSecs - device read time out value in seconds
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int transact(char *snd, int sizeSnd, char *rcv, struct tl_cond_stream *cs, int sizeRcv, int opTimeoutSecs) {
+	int retry;
+	int actualcCnt;
+	int retval = SUCCESS;
+	uint8_t status;
+
+	for (retry = 0; retry < max(maxRetries, 1); retry++) {
+		if (isShutDown) {
+			return -EPERM;
+		}
+		if (retry > 0 && !is_replaying()) {
+			retval = recover_usb(retry);
+			if (retval != SUCCESS) {
+				return retval;
+			}
+		}
+		if (fatal_signal_pending(current)) {
+			return -EINTR;
+		}
+		if (!is_replaying() && READ_ONCE(tlDev->isDisconnected)) {
+			return -ENODEV;
+		}
+		if (!is_replaying() && READ_ONCE(tlDev->isResetting)) {
+			// The reset waits for the lock, the next refill goes to the reset device
+			return -EIO;
+		}
+		if (is_replaying()) {
+			retval = traffic_replay_cmd(snd, sizeSnd);
+			if (retval == -ENODATA) {
+				return retval;
+			}
+			actualcCnt = sizeSnd;
+		} else {
+			if (tlDev->needsDrain) {
+				drain_bulk_in();
+			}
+			retval = send_cmd(snd, sizeSnd, &actualcCnt);
+			traffic_record(TRAFFIC_REC_CMD, retval, snd, retval == SUCCESS ? actualcCnt : 0);
+		}
+		if (retval == -EINTR) {
+			return retval;
+		}
+		if (retval == SUCCESS && actualcCnt == sizeSnd) {
+			if (cs != NULL) {
+				tl_cond_streamRestart(cs);
+			}
+			retval = receive_response(rcv, cs, sizeRcv + 1, opTimeoutSecs);
+			if (retval != SUCCESS && !is_replaying()) {
+				// The rest of the response may still arrive ahead of the next one
+				tlDev->needsDrain = true;
+			}
+			if (retval == -EINTR) {
+				return retval;
+			}
+			if (retval == SUCCESS) {
+				status = cs != NULL ? cs->tail[0] : rcv[sizeRcv];
+				if (status != 0) {
+					retval = -EFAULT;
+					#ifdef inDebugMode
+						printk(KERN_INFO "Received an invalid device status code %d\n", status);
+					#endif
+				} else {
+					break;
+				}
+			}
+		} else {
+			continue;
+		}
+	}
+	if (retry >= max(maxRetries, 1)) {
+		retval = -ETIMEDOUT;
+	}
+	return retval;
+}
+
+/**
+ * Wait before retrying a failed command and escalate the recovery with the number of consecutive
+ * failures: back off only, then also clear the endpoint halts, then also queue a device reset.
+ * No reset is queued while probing since the probe holds the device lock
+ *
+ * @param int failures - number of consecutive failures so far
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int recover_usb(int failures) {
+	long backoffMsecs;
+
+	retryCount++;
+	backoffMsecs = min_t(long, (long)retryBackoffMsecs << min(failures - 1, 16), retryBackoffMaxMsecs);
+	if (backoffMsecs > 0) {
+		schedule_timeout_killable(msecs_to_jiffies(backoffMsecs));
+		if (fatal_signal_pending(current)) {
+			return -EINTR;
+		}
+	}
+	if (READ_ONCE(tlDev->isDisconnected)) {
+		return -ENODEV;
+	}
+
+	if (!isProbing && resetAfter > 0 && failures >= resetAfter && failures % resetAfter == 0) {
+		// The caller holds dataOpLock, so hand the reset to the USB core instead of waiting for it;
+		// usb_pre_reset() kills the transfers in flight and the next retry drains the device
+		printk(KERN_INFO "Resetting the USB device after %d failures\n", failures);
+		usb_queue_reset_device(usbData->interface);
+		resetCount++;
+	} else if (clearHaltAfter > 0 && failures >= clearHaltAfter) {
+		usb_clear_halt(usbData->udev, usb_sndbulkpipe(usbData->udev, usbData->bulk_out_endpointAddr));
+		usb_clear_halt(usbData->udev, usb_rcvbulkpipe(usbData->udev, usbData->bulk_in_endpointAddr));
+		haltClearCount++;
+	}
+	return SUCCESS;
+}
+
+/**
+ * A function to handle TL device receive command
+ * @param char *buff - a pointer to the data receive buffer
+ * @param int length - how many bytes expected to receive
+ * @param int opTimeoutSecs - device read time out value in seconds
+
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int chip_read_data(char *buff, int length, int opTimeoutSecs) {
+	return receive_response(buff, NULL, length, opTimeoutSecs);
+}
+
+/**
+ * Receive a TL device response, either into a buffer or straight from the bulk-in transfer buffers
+ * into a conditioning stream
+ *
+ * @param char *buff - a pointer to the data receive buffer, not used with a stream
+ * @param struct tl_cond_stream *cs - a conditioning stream for the data, NULL to receive into 'buff'
+ * @param int length - how many bytes expected to receive
+ * @param int opTimeoutSecs - device read time out value in seconds
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int receive_response(char *buff, struct tl_cond_stream *cs, int length, int opTimeoutSecs) {
+	int transferred;
+	ktime_t deadline;
+	s64 leftMsecs;
+	int cnt;
+	int retval;
+	uint8_t *inBuff;
+	int bulkInSize;
+	int numReqs;
+	int head;
+	int i;
+	struct bulk_in_req *req;
+
+	deadline = ktime_add_ms(ktime_get(), readTimeoutMsecs > 0 ? readTimeoutMsecs : opTimeoutSecs * MSEC_PER_SEC);
+
+	// Keep enough bulk-in transfers in flight to cover the whole response
+	numReqs = 0;
+	head = 0;
+	retval = SUCCESS;
+	if (!is_replaying()) {
+		bulkInSize = usbData->bulk_in_size;
+		numReqs = DIV_ROUND_UP(length + DIV_ROUND_UP(length, bulkInSize - TL_FTDI_STATUS_BYTES) * TL_FTDI_STATUS_BYTES, USB_BUFFER_SIZE);
+		numReqs = clamp(numReqs, 1, tlDev->numBulkIn);
+		for (i = 0; i < numReqs && retval == SUCCESS; i++) {
+			retval = submit_bulk_in(&tlDev->bulkIn[i]);
+		}
+	}
+
+	cnt = 0;
+	while (retval == SUCCESS) {
+		if (isShutDown) {
+			retval = -EPERM;
+			break;
+		}
+		if (is_replaying()) {
+			retval = traffic_replay_bulk_in(&inBuff, &transferred);
+			bulkInSize = replayBulkInSize;
+		} else {
+			req = &tlDev->bulkIn[head];
+			leftMsecs = max_t(s64, ktime_ms_delta(deadline, ktime_get()), 1);
+			retval = wait_bulk_in(req, stallTimeoutMsecs > 0 ? min_t(s64, stallTimeoutMsecs, leftMsecs) : leftMsecs, &transferred);
+			inBuff = req->buffer;
+			traffic_record(TRAFFIC_REC_BULK_IN, retval, inBuff, retval == SUCCESS ? transferred : 0);
+		}
+		#ifdef inDebugMode
+			printk(KERN_INFO "chip_read_data retval %d transferred %d, length %d\n", retval, transferred, length);
+		#endif
+		if (retval) {
+			break;
+		}
+
+		if (transferred > USB_BUFFER_SIZE) {
+			printk(KERN_ALERT "Received unexpected bytes when processing USB device request\n");
+			retval = -EFAULT;
+			break;
+		}
+
+		if (cs != NULL) {
+			cnt = tl_ftdi_deframeToStream(inBuff, transferred, bulkInSize, cs, cnt, length);
+		} else {
+			cnt = tl_ftdi_deframe(inBuff, transferred, bulkInSize, (uint8_t *)buff, cnt, length);
+		}
+		if (cnt >= length || !ktime_before(ktime_get(), deadline)) {
+			break;
+		}
+		if (!is_replaying()) {
+			// Reuse the transfer for the data still to come
+			retval = submit_bulk_in(req);
+			head = (head + 1) % numReqs;
+		}
+	}
+
+	if (numReqs > 0) {
+		// Nothing more is expected for this command
+		usb_kill_anchored_urbs(&tlDev->urbAnchor);
+	}
+	if (retval) {
+		return retval;
+	}
+
+	if (cnt != length) {
+		#ifdef inDebugMode
+			printk(KERN_INFO "timeout received, cnt %d\n", cnt);
+		#endif
+		return -ETIMEDOUT;
+	}
+
+	return SUCCESS;
+}
+
+/**
+ * A function to handle the completion of a bulk transfer
+ *
+ * @param struct urb *urb - the completed URB, the context is the completion to signal
+ *
+ */
+static void urb_callback(struct urb *urb) {
+	complete(urb->context);
+}
+
+/**
+ * Submit a bulk-in transfer
+ *
+ * @param struct bulk_in_req *req - the bulk-in transfer
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int submit_bulk_in(struct bulk_in_req *req) {
+	int retval;
+
+	if (READ_ONCE(tlDev->isDisconnected)) {
+		return -ENODEV;
+	}
+	if (READ_ONCE(tlDev->isResetting)) {
+		return -EIO;
+	}
+	reinit_completion(&req->done);
+	usb_fill_bulk_urb(req->urb, usbData->udev, usb_rcvbulkpipe(usbData->udev, usbData->bulk_in_endpointAddr),
+			req->buffer, USB_BUFFER_SIZE, urb_callback, &req->done);
+	usb_anchor_urb(req->urb, &tlDev->urbAnchor);
+	retval = usb_submit_urb(req->urb, GFP_KERNEL);
+	if (retval) {
+		usb_unanchor_urb(req->urb);
+		printk(KERN_ALERT "Could not submit a bulk-in transfer, error %d\n", retval);
+	}
+	return retval;
+}
+
+/**
+ * Wait for a bulk-in transfer to complete
+ *
+ * @param struct bulk_in_req *req - the bulk-in transfer
+ * @param long timeoutMsecs - how many milliseconds to wait
+ * @param int *transferred - set to the number of bytes received
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int wait_bulk_in(struct bulk_in_req *req, long timeoutMsecs, int *transferred) {
+	return wait_urb(req->urb, &req->done, msecs_to_jiffies(timeoutMsecs), transferred);
+}
+
+/**
+ * Wait for a submitted URB to complete. The URB is cancelled when the wait times out or the
+ * caller is killed, after which it can be submitted again.
+ *
+ * @param struct urb *urb - the submitted URB
+ * @param struct completion *done - the completion signaled by the URB callback
+ * @param long timeoutJiffies - how long to wait
+ * @param int *transferred - set to the number of bytes transferred
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int wait_urb(struct urb *urb, struct completion *done, long timeoutJiffies, int *transferred) {
+	long left;
+
+	*transferred = 0;
+	left = wait_for_completion_killable_timeout(done, timeoutJiffies);
+	if (left <= 0) {
+		usb_kill_urb(urb);
+		return left == 0 ? -ETIMEDOUT : -EINTR;
+	}
+	*transferred = urb->actual_length;
+	return urb->status;
+}
+
+/**
+ * Send a command to the TL device
+ *
+ * @param char *snd - a pointer to the command, a DMA capable buffer
+ * @param int sizeSnd - how many bytes in command
+ * @param int *transferred - set to the number of bytes sent
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int send_cmd(char *snd, int sizeSnd, int *transferred) {
+	struct urb *urb = tlDev->cmdUrb;
+	int retval;
+
+	*transferred = 0;
+	if (READ_ONCE(tlDev->isDisconnected)) {
+		return -ENODEV;
+	}
+	if (READ_ONCE(tlDev->isResetting)) {
+		return -EIO;
+	}
+	reinit_completion(&tlDev->cmdDone);
+	usb_fill_bulk_urb(urb, usbData->udev, usb_sndbulkpipe(usbData->udev, usbData->bulk_out_endpointAddr),
+			snd, sizeSnd, urb_callback, &tlDev->cmdDone);
+	usb_anchor_urb(urb, &tlDev->urbAnchor);
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (retval) {
+		usb_unanchor_urb(urb);
+		printk(KERN_ALERT "Could not submit a bulk-out transfer, error %d\n", retval);
+		return retval;
+	}
+	return wait_urb(urb, &tlDev->cmdDone, msecs_to_jiffies(max(cmdTimeoutMsecs, 1)), transferred);
+}
+
+/**
+ * Discard what is left of an aborted response, so it is not taken for the start of the next one.
+ * The FTDI chip sends bare status packets once its FIFO is empty.
+ *
+ */
+static void drain_bulk_in(void) {
+	struct bulk_in_req *req = &tlDev->bulkIn[0];
+	int transferred;
+	int i;
+
+	for (i = 0; i < DRAIN_MAX_TRANSFERS; i++) {
+		if (submit_bulk_in(req) != SUCCESS) {
+			break;
+		}
+		if (wait_bulk_in(req, DRAIN_WAIT_MSECS, &transferred) != SUCCESS
+				|| transferred <= TL_FTDI_STATUS_BYTES) {
+			break;
+		}
+	}
+	usb_kill_anchored_urbs(&tlDev->urbAnchor);
+	tlDev->needsDrain = false;
+}
+
+/**
+ * Check if random bytes can be supplied, either from a TL device or from a replayed USB traffic recording
+ *
+ * @return true when the entropy source is ready
+ *
+ */
+static bool is_entropy_src_rdy(void) {
+	if (isShutDown) {
+		return false;
+	}
+	return (isEntropySrcRdy && !isStartupPending) || is_replaying();
+}
+
+/**
+ * Check if the USB traffic is replayed from a recording instead of a TL device
+ *
+ * @return true when replaying
+ *
+ */
+static bool is_replaying(void) {
+	return IS_ENABLED(CONFIG_TLRANDOM_TRAFFIC) && (trafficMode == TRAFFIC_REPLAY_TIMED || trafficMode == TRAFFIC_REPLAY_FAST);
+}
+
+/**
+ * Allocate the USB traffic recording buffer if not done already
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int alloc_traffic_buff(void) {
+	if (trafficBuff == NULL) {
+		trafficBuff = vmalloc((size_t)trafficBuffKb * 1024);
+		if (trafficBuff == NULL) {
+			printk(KERN_ALERT "Could not allocate %d KB for the USB traffic recording\n", trafficBuffKb);
+			return -ENOMEM;
 		}
+	}
+	return SUCCESS;
+}
 
-		if (rct.statusByte != SUCCESS) {
-			printk(KERN_ALERT "Repetition Count Test failure\n");
-			retval = -EPERM;
-		} else if (apt.statusByte != SUCCESS) {
-			printk(KERN_ALERT "Adaptive Proportion Test failure\n");
-			retval = -EPERM;
+/**
+ * Save the conditioner state that determines the conditioned output
+ *
+ * @param struct traffic_start *start - set to the nonce and the conditioning profile in use
+ *
+ */
+static void traffic_save_state(struct traffic_start *start) {
+	memset(start, 0x00, sizeof(*start));
+	start->magic = TRAFFIC_MAGIC;
+	start->version = TRAFFIC_VERSION;
+	start->blockSerialNumber = shaData.blockSerialNumber;
+	start->condProfile = condProfile;
+	start->deviceId = shaData.deviceId;
+	start->bootSeed = shaData.bootSeed;
+	start->sliceId = shaData.sliceId;
+	start->isSeeded = shaData.isSeeded;
+}
+
+/**
+ * Restore the conditioner state saved by traffic_save_state()
+ *
+ * @param const struct traffic_start *start - the nonce and the conditioning profile to restore
+ *
+ */
+static void traffic_restore_state(const struct traffic_start *start) {
+	tl_sha256_initializeSerialNumber(&shaData, start->blockSerialNumber);
+	tl_cond_initializeNonce(&shaData, start->deviceId, start->sliceId);
+	shaData.bootSeed = start->bootSeed;
+	shaData.isSeeded = start->isSeeded;
+#ifndef CONFIG_TLRANDOM_COND_PROFILE
+	condProfile = start->condProfile;
+#endif
+}
+
+/**
+ * Append a record to the USB traffic recording when recording is enabled
+ *
+ * @param uint8_t type - the record type
+ * @param int32_t status - the result of the USB operation
+ * @param const void *data - pointer to the record payload
+ * @param uint32_t length - number of payload bytes
+ *
+ */
+static void traffic_record(uint8_t type, int32_t status, const void *data, uint32_t length) {
+	struct traffic_rec rec;
+	struct traffic_start start;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_TRAFFIC) || trafficMode != TRAFFIC_RECORD || trafficBuff == NULL || isTrafficSkipped) {
+		return;
+	}
+
+	if (isTrafficStartPending) {
+		// The recording starts with the state needed to reproduce the conditioned output
+		isTrafficStartPending = false;
+		traffic_save_state(&start);
+		start.bulkInSize = usbData->bulk_in_size;
+		traffic_record(TRAFFIC_REC_START, SUCCESS, &start, sizeof(start));
+	}
+
+	if (trafficLen + sizeof(rec) + length > (size_t)trafficBuffKb * 1024) {
+		trafficDropped++;
+		return;
+	}
+
+	memset(&rec, 0x00, sizeof(rec));
+	rec.type = type;
+	rec.status = status;
+	rec.length = length;
+	rec.timestampNs = ktime_get_ns();
+	memcpy(trafficBuff + trafficLen, &rec, sizeof(rec));
+	memcpy(trafficBuff + trafficLen + sizeof(rec), data, length);
+	trafficLen += sizeof(rec) + length;
+}
+
+/**
+ * Calculate a SHA-256 digest of a conditioned output buffer
+ *
+ * @param const uint8_t *buff - pointer to the conditioned bytes, a multiple of the hash size
+ * @param int length - number of bytes
+ * @param uint32_t *digest - pointer to 8 X 32 bit words for the digest
+ *
+ */
+static void traffic_output_digest(const uint8_t *buff, int length, uint32_t *digest) {
+	// The input of every hash is the previous digest followed by a chunk of the output
+	static uint32_t chunk[TL_SHA256_OUT_WORDS * 64];
+	static struct tl_sha256_data digestShaData;
+	const int chunkBytes = sizeof(chunk) - TL_SHA256_OUT_WORDS * WORD_SIZE_BYTES;
+	int offset;
+	int cnt;
+
+	memset(digest, 0x00, TL_SHA256_OUT_WORDS * WORD_SIZE_BYTES);
+	for (offset = 0; offset < length; offset += cnt) {
+		cnt = min(length - offset, chunkBytes);
+		memcpy(chunk, digest, TL_SHA256_OUT_WORDS * WORD_SIZE_BYTES);
+		memcpy(chunk + TL_SHA256_OUT_WORDS, buff + offset, cnt);
+		tl_sha256_generateHash(&digestShaData, chunk, TL_SHA256_OUT_WORDS + cnt / WORD_SIZE_BYTES, digest);
+	}
+}
+
+/**
+ * Record the digest of the conditioned output, or compare it with the recorded one when replaying
+ *
+ * @param const uint8_t *buff - pointer to the conditioned bytes
+ * @param int length - number of bytes
+ *
+ */
+static void traffic_record_output(const uint8_t *buff, int length) {
+	uint32_t digest[TL_SHA256_OUT_WORDS];
+	struct traffic_rec *rec;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_TRAFFIC)) {
+		return;
+	}
+	if (trafficMode == TRAFFIC_RECORD) {
+		traffic_output_digest(buff, length, digest);
+		traffic_record(TRAFFIC_REC_OUTPUT, SUCCESS, digest, sizeof(digest));
+	} else if (is_replaying()) {
+		rec = traffic_rec_at(trafficPos);
+		if (rec == NULL || rec->type != TRAFFIC_REC_OUTPUT) {
+			return;
+		}
+		trafficPos += sizeof(*rec) + rec->length;
+		traffic_output_digest(buff, length, digest);
+		if (rec->length == sizeof(digest) && memcmp(rec + 1, digest, sizeof(digest)) == 0) {
+			replayOutputMatches++;
+		} else {
+			replayOutputMismatches++;
+			printk(KERN_ALERT "Replayed output does not match the recorded output\n");
 		}
 	}
+}
 
-	isUsbOpPending = false;
-	return retval;
+/**
+ * Get the next record from the USB traffic recording and wait for its original time when replaying at original timing
+ *
+ * @return struct traffic_rec * - pointer to the next record, NULL at the end of the recording
+ *
+ */
+static struct traffic_rec *traffic_replay_next(void) {
+	struct traffic_rec *rec;
+
+	for (;;) {
+		rec = traffic_rec_at(trafficPos);
+		if (rec == NULL) {
+			return NULL;
+		}
+		trafficPos += sizeof(*rec) + rec->length;
+		// Digests of a skipped refill are of no use
+		if (rec->type != TRAFFIC_REC_OUTPUT) {
+			break;
+		}
+	}
+
+	if (trafficMode == TRAFFIC_REPLAY_TIMED && replayStartNs == 0) {
+		// The original timing is kept from the first replayed record on
+		replayStartNs = ktime_get_ns() - (rec->timestampNs - trafficFirstNs);
+	}
+	return rec;
 }
 
 /**
- * Send a TL device command and receive response
+ * Get a record of the USB traffic recording
  *
- * @param char *snd -  a pointer to the command
- * @param int sizeSnd - how many bytes in command
- * @param char *rcv - a pointer to the data receive buffer
- * @param int sizeRcv - how many bytes expected to receive
- * @param int opTimeoutSecs - device read time out value in seconds
+ * @param size_t pos - offset of the record in the recording
+ * @return struct traffic_rec * - the record, NULL when its header or its payload runs past the end of the recording
  *
- * @return 0 - successful operation, otherwise the error code (a negative number)
+ */
+static struct traffic_rec *traffic_rec_at(size_t pos) {
+	struct traffic_rec *rec;
+
+	if (trafficBuff == NULL || pos > trafficLen || trafficLen - pos < sizeof(*rec)) {
+		return NULL;
+	}
+	rec = (struct traffic_rec *)(trafficBuff + pos);
+	if (rec->length > trafficLen - pos - sizeof(*rec)) {
+		return NULL;
+	}
+	return rec;
+}
+
+/**
+ * When replaying at original timing, sleep until the recorded device finished answering the next
+ * command. Called without 'dataOpLock' held before a refill takes it, so readers and ioctls are not
+ * stalled by the recorded gaps, the replayed command then runs without waiting.
  *
  */
-static int snd_rcv_usb_data(char *snd, int sizeSnd, char *rcv, int sizeRcv, int opTimeoutSecs) {
-	int retry;
-	int actualcCnt;
-	int retval = SUCCESS;
+static void traffic_replay_wait(void) {
+	struct traffic_rec *rec;
+	size_t pos;
+	uint64_t endNs;
+	int64_t waitNs;
 
-	for (retry = 0; retry < USB_READ_MAX_RETRY_CNT; retry++) {
-		if (isShutDown) {
-			return -EPERM;
+	if (!IS_ENABLED(CONFIG_TLRANDOM_TRAFFIC) || READ_ONCE(trafficMode) != TRAFFIC_REPLAY_TIMED) {
+		return;
+	}
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		return;
+	}
+	waitNs = 0;
+	rec = traffic_rec_at(trafficPos);
+	if (trafficMode == TRAFFIC_REPLAY_TIMED && replayStartNs != 0 && rec != NULL) {
+		// The records of one command end where the next command starts
+		endNs = rec->timestampNs;
+		for (pos = trafficPos + sizeof(*rec) + rec->length; (rec = traffic_rec_at(pos)) != NULL && rec->type != TRAFFIC_REC_CMD;
+				pos += sizeof(*rec) + rec->length) {
+			endNs = rec->timestampNs;
 		}
-		retval = usb_bulk_msg(usbData->udev, usb_sndbulkpipe(usbData->udev, usbData->bulk_out_endpointAddr), snd, sizeSnd, &actualcCnt, HZ*10);
-		if (retval == SUCCESS && actualcCnt == sizeSnd) {
-			retval = chip_read_data(rcv, sizeRcv + 1, opTimeoutSecs);
-			if (retval == SUCCESS) {
-				if (rcv[sizeRcv] != 0) {
-					retval = -EFAULT;
-					#ifdef inDebugMode
-						printk(KERN_INFO "Received an invalid device status code %d\n", rcv[sizeRcv]);
-					#endif
-				} else {
-					break;
-				}
+		waitNs = (int64_t)(endNs - trafficFirstNs) - (int64_t)(ktime_get_ns() - replayStartNs);
+	}
+	mutex_unlock(&dataOpLock);
+
+	if (waitNs > NSEC_PER_MSEC * 20) {
+		msleep_interruptible(waitNs / NSEC_PER_MSEC);
+	} else if (waitNs > NSEC_PER_USEC * 10) {
+		usleep_range(waitNs / NSEC_PER_USEC, waitNs / NSEC_PER_USEC + 10);
+	}
+}
+
+/**
+ * Get the byte count of the next recorded 'x' command
+ *
+ * @param int room - free bytes in the output buffer
+ * @return int - number of raw bytes requested by the recorded command, 0 when not known
+ *
+ */
+static int traffic_replay_xfer_bytes(int room) {
+	struct traffic_rec *rec;
+	size_t pos;
+	int byteCnt;
+
+	for (pos = trafficPos; (rec = traffic_rec_at(pos)) != NULL; pos += sizeof(*rec) + rec->length) {
+		if (rec->type == TRAFFIC_REC_CMD) {
+			if (rec->length != 3 || ((uint8_t *)(rec + 1))[0] != 'x') {
+				return 0;
 			}
-		} else {
-			continue;
+			byteCnt = ((uint8_t *)(rec + 1))[1] | (((uint8_t *)(rec + 1))[2] << 8);
+			if (byteCnt == 0 || byteCnt / cond_block_bytes() * OUT_NUM_WORDS * WORD_SIZE_BYTES > room
+					|| byteCnt % cond_block_bytes() != 0) {
+				return 0;
+			}
+			return byteCnt;
 		}
 	}
-	if (retry >= USB_READ_MAX_RETRY_CNT) {
-		retval = -ETIMEDOUT;
+	return 0;
+}
+
+/**
+ * Replay sending a TL device command
+ *
+ * @param const char *snd - pointer to the command
+ * @param int sizeSnd - how many bytes in command
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int traffic_replay_cmd(const char *snd, int sizeSnd) {
+	struct traffic_rec *rec;
+
+	// Skip whatever is left of the previous command
+	do {
+		rec = traffic_replay_next();
+	} while (rec != NULL && rec->type != TRAFFIC_REC_CMD);
+
+	if (rec == NULL) {
+		printk(KERN_INFO "End of the replayed USB traffic\n");
+		return -ENODATA;
 	}
-	return retval;
+	if (rec->length != (uint32_t)sizeSnd || memcmp(rec + 1, snd, sizeSnd) != 0) {
+		replayCmdMismatches++;
+		#ifdef inDebugMode
+			printk(KERN_INFO "Replayed command does not match the recorded command\n");
+		#endif
+	}
+	return rec->status;
 }
 
 /**
- * A function to handle TL device receive command
- * @param char *buff - a pointer to the data receive buffer
- * @param int length - how many bytes expected to receive
- * @param int opTimeoutSecs - device read time out value in seconds
+ * Replay receiving a bulk-in transfer
+ *
+ * @param uint8_t **buff - set to point to the recorded bulk-in transfer
+ * @param int *transferred - set to the number of bytes in the recorded bulk-in transfer
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int traffic_replay_bulk_in(uint8_t **buff, int *transferred) {
+	struct traffic_rec *rec;
+
+	rec = traffic_rec_at(trafficPos);
+	if (rec != NULL && rec->type != TRAFFIC_REC_BULK_IN) {
+		// The recorded device sent no more data for this command
+		return -ETIMEDOUT;
+	}
+	rec = traffic_replay_next();
+	if (rec == NULL) {
+		printk(KERN_INFO "End of the replayed USB traffic\n");
+		return -ENODATA;
+	}
+	*buff = (uint8_t *)(rec + 1);
+	*transferred = rec->length;
+	return rec->status;
+}
 
+#ifdef CONFIG_TLRANDOM_TRAFFIC
+/**
+ * Handle changes of the 'traffic_mode' module parameter
+ *
+ * @param const char *val - the new parameter value
+ * @param const struct kernel_param *kp - the parameter
  * @return 0 - successful operation, otherwise the error code (a negative number)
  *
  */
-static int chip_read_data(char *buff, int length, int opTimeoutSecs) {
-	long secsWaited;
-	int transferred;
-	ktime_t start, end;
-	int cnt;
-	int i;
+static int set_traffic_mode(const char *val, const struct kernel_param *kp) {
+	int mode;
 	int retval;
+	struct traffic_rec *rec;
+	struct traffic_start *start;
 
-	start = get_seconds();
+	retval = kstrtoint(val, 0, &mode);
+	if (retval != SUCCESS) {
+		return retval;
+	}
+	if (mode < TRAFFIC_OFF || mode > TRAFFIC_REPLAY_FAST) {
+		return -EINVAL;
+	}
 
-	cnt = 0;
-	do {
-		if (isShutDown) {
-			return -EPERM;
+	if (!isTrafficRdy) {
+		// Set when loading the module, there is no recording to replay yet
+		if (mode != TRAFFIC_OFF && mode != TRAFFIC_RECORD) {
+			return -EINVAL;
 		}
-		retval = usb_bulk_msg(usbData->udev, usb_rcvbulkpipe(usbData->udev, usbData->bulk_in_endpointAddr), usbData->bulk_in_buffer, USB_BUFFER_SIZE, &transferred, HZ*50);
-		#ifdef inDebugMode
-			printk(KERN_INFO "chip_read_data retval %d transferred %d, length %d\n", retval, transferred, length);
-		#endif
-		if (retval) {
-			return retval;
+		trafficMode = mode;
+		return SUCCESS;
+	}
+
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		return -EINTR;
+	}
+	reservoir_close();
+
+	if (mode == TRAFFIC_RECORD) {
+		retval = alloc_traffic_buff();
+		if (retval == SUCCESS) {
+			trafficLen = 0;
+			trafficDropped = 0;
+			isTrafficStartPending = true;
+		}
+	} else if (mode == TRAFFIC_REPLAY_TIMED || mode == TRAFFIC_REPLAY_FAST) {
+		rec = traffic_rec_at(0);
+		start = rec != NULL ? (struct traffic_start *)(rec + 1) : NULL;
+		if (rec == NULL || rec->type != TRAFFIC_REC_START || rec->length < sizeof(*start)
+				|| start->magic != TRAFFIC_MAGIC || start->version != TRAFFIC_VERSION || !is_cond_profile_built(start->condProfile)) {
+			printk(KERN_ALERT "No valid USB traffic recording loaded\n");
+			retval = -EINVAL;
+		} else {
+			// Put the live state aside, a replay started over another keeps the one already saved
+			if (!is_replaying()) {
+				traffic_save_state(&liveState);
+			}
+			// Restore the state the recording was made with
+			traffic_restore_state(start);
+			replayBulkInSize = start->bulkInSize;
+			trafficFirstNs = rec->timestampNs;
+			trafficPos = sizeof(*rec) + rec->length;
+			replayStartNs = 0;
+			replayOutputMatches = 0;
+			replayOutputMismatches = 0;
+			replayCmdMismatches = 0;
+			// Start over with a fresh buffer
+			trngOutLen = 0;
+			curTrngOutIdx = 0;
+			audit_reset();
+		}
+	} else if (trafficMode != TRAFFIC_OFF) {
+		if (is_replaying()) {
+			// Continue the live output with the nonce it had before the replay
+			traffic_restore_state(&liveState);
 		}
+		trngOutLen = 0;
+		curTrngOutIdx = 0;
+	}
 
-		if (transferred > USB_BUFFER_SIZE) {
-			printk(KERN_ALERT "Received unexpected bytes when processing USB device request\n");
-			return -EFAULT;
+	if (retval == SUCCESS) {
+		trafficMode = mode;
+	}
+	reservoir_open();
+	mutex_unlock(&dataOpLock);
+	// A replay changes the conditioning the hwrng quality stands for
+	update_hwrng();
+	return retval;
+}
+#endif
+
+/**
+ * Open the USB traffic recording debugfs file, opening it for writing with truncation discards the recording
+ *
+ * @param struct inode *inode - pointer to the inode structure of the caller
+ * @param struct file *file -  pointer to the file structure of the caller
+ * @return 0 - successfully, otherwise the error code (a negative number)
+ *
+ */
+static int traffic_open(struct inode *inode, struct file *file) {
+	if ((file->f_mode & FMODE_WRITE) && (file->f_flags & O_TRUNC)) {
+		if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+			return -EINTR;
+		}
+		if (trafficMode == TRAFFIC_OFF) {
+			trafficLen = 0;
+		}
+		mutex_unlock(&dataOpLock);
+	}
+	return SUCCESS;
+}
+
+/**
+ * Download the USB traffic recording
+ *
+ * @param struct file *file - pointer to the file structure of the caller
+ * @param char __user *buffer - pointer to the buffer in the user space
+ * @param size_t length - size in bytes for the read operation
+ * @param loff_t * offset - position in the recording
+ * @return greater than 0 - number of bytes actually read, otherwise the error code (a negative number)
+ *
+ */
+static ssize_t traffic_read(struct file *file, char __user *buffer, size_t length, loff_t *offset) {
+	ssize_t retval;
+
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		return -EINTR;
+	}
+	retval = simple_read_from_buffer(buffer, length, offset, trafficBuff, trafficBuff ? trafficLen : 0);
+	mutex_unlock(&dataOpLock);
+	return retval;
+}
+
+/**
+ * Upload a USB traffic recording for replay, the data is appended to the current recording
+ *
+ * @param struct file *file - pointer to the file structure of the caller
+ * @param const char __user *buffer - pointer to the buffer in the user space
+ * @param size_t length - size in bytes for the write operation
+ * @param loff_t * offset - position in the recording
+ * @return greater than 0 - number of bytes actually written, otherwise the error code (a negative number)
+ *
+ */
+static ssize_t traffic_write(struct file *file, const char __user *buffer, size_t length, loff_t *offset) {
+	ssize_t retval;
+
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		return -EINTR;
+	}
+	if (trafficMode != TRAFFIC_OFF) {
+		// Never change a recording that is in use
+		retval = -EBUSY;
+	} else {
+		retval = alloc_traffic_buff();
+	}
+	if (retval == SUCCESS) {
+		if (trafficLen + length > (size_t)trafficBuffKb * 1024) {
+			retval = -ENOSPC;
+		} else if (copy_from_user(trafficBuff + trafficLen, buffer, length)) {
+			retval = -EFAULT;
+		} else {
+			trafficLen += length;
+			*offset += length;
+			retval = length;
+		}
+	}
+	mutex_unlock(&dataOpLock);
+	return retval;
+}
+
+/**
+ * Show the USB traffic record and replay status
+ *
+ * @param struct seq_file *m - the output file
+ * @param void *v - not used
+ * @return 0 - always
+ *
+ */
+static int traffic_status_show(struct seq_file *m, void *v) {
+	seq_printf(m, "mode: %d\n", trafficMode);
+	seq_printf(m, "recording bytes: %zu of %d\n", trafficLen, trafficBuffKb * 1024);
+	seq_printf(m, "dropped records: %lu\n", trafficDropped);
+	seq_printf(m, "replay position: %zu\n", trafficPos);
+	seq_printf(m, "replay output matches: %lu\n", replayOutputMatches);
+	seq_printf(m, "replay output mismatches: %lu\n", replayOutputMismatches);
+	seq_printf(m, "replay command mismatches: %lu\n", replayCmdMismatches);
+	return SUCCESS;
+}
+
+static int traffic_status_open(struct inode *inode, struct file *file) {
+	return single_open(file, traffic_status_show, NULL);
+}
+
+static const struct file_operations trafficFops = {
+	.owner = THIS_MODULE,
+	.open = traffic_open,
+	.read = traffic_read,
+	.write = traffic_write,
+	.llseek = default_llseek,
+};
+
+static const struct file_operations trafficStatusFops = {
+	.owner = THIS_MODULE,
+	.open = traffic_status_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * Show the transfer and power management statistics
+ *
+ * @param struct seq_file *m - the output file
+ * @param void *v - not used
+ * @return 0 - always
+ *
+ */
+static int stats_show(struct seq_file *m, void *v) {
+	static const char * const qosClassNames[TLRANDOM_QOS_CLASSES] = { "critical", "normal", "bulk" };
+	struct express_pool *pool;
+	int node;
+	int i;
+
+	seq_printf(m, "conditioning profile: %s\n", condProfiles[condProfile].name);
+	seq_printf(m, "output entropy per mille: %d\n", cond_entropy_per_mille());
+	seq_printf(m, "device model: %s\n", devModel->name);
+	seq_printf(m, "device expected rate bytes/s: %d\n", devModel->expectedRate);
+	seq_printf(m, "hwrng quality: %d\n", cond_quality());
+	seq_printf(m, "hwrng registered: %d\n", isHwrngRegistered);
+	seq_printf(m, "startup pending: %d\n", isStartupPending);
+	seq_printf(m, "startup ms: %lld\n", isStartupPending ? 0 : startupMsecs);
+	seq_printf(m, "startup failures: %lu\n", startupFailCount);
+	seq_printf(m, "output buffer bytes: %d\n", outBufferBytes);
+	seq_printf(m, "output buffer node: %d\n", outBufferNode);
+	seq_printf(m, "reservoir bytes: %d\n", reservoir_unread());
+	seq_printf(m, "disconnects: %lu\n", disconnectCount);
+	seq_printf(m, "replug waits: %lu\n", replugWaitCount);
+	seq_printf(m, "producer node: %d\n", producer_node());
+	seq_printf(m, "usb controller node: %d\n", usbNode);
+	seq_printf(m, "cross-node read bytes: %ld\n", atomic_long_read(&crossNodeReadBytes));
+	seq_printf(m, "cross-node refills: %lu\n", crossNodeRefills);
+	seq_printf(m, "cross-node express fill bytes: %lu\n", crossNodeFillBytes);
+	seq_printf(m, "delivered bytes: %lu\n", delivered_bytes());
+	for_each_online_node(node) {
+		pool = expressPools[node];
+		if (pool == NULL) {
+			continue;
 		}
+		seq_printf(m, "node %d express pool bytes: %d\n", node, pool->len - pool->idx);
+		seq_printf(m, "node %d express hits: %lu\n", node, pool->hits);
+		seq_printf(m, "node %d express misses: %lu\n", node, pool->misses);
+		seq_printf(m, "node %d express delivered bytes: %lu\n", node, pool->delivered);
+		seq_printf(m, "node %d express fills: %lu\n", node, pool->fills);
+	}
+	seq_printf(m, "refills: %lu\n", refillCount);
+	seq_printf(m, "last transfer bytes: %d\n", lastXferBytes);
+	seq_printf(m, "demand rate bytes/s: %lu\n", demandRate);
+	seq_printf(m, "average read bytes: %lu\n", avgReadSize);
+	seq_printf(m, "suspended: %d\n", isDevSuspended);
+	seq_printf(m, "suspends: %lu\n", suspendCount);
+	seq_printf(m, "wake-ups: %lu\n", wakeCount);
+	seq_printf(m, "wake-up latency last us: %lld\n", wakeUsLast);
+	seq_printf(m, "wake-up latency avg us: %lld\n", wakeCount ? wakeUsTotal / (s64)wakeCount : 0);
+	seq_printf(m, "wake-up latency max us: %lld\n", wakeUsMax);
+	seq_printf(m, "prefetches: %lu\n", prefetchCount);
+	seq_printf(m, "retries: %lu\n", retryCount);
+	seq_printf(m, "endpoint halt clears: %lu\n", haltClearCount);
+	seq_printf(m, "device resets: %lu\n", resetCount);
+	seq_printf(m, "bulk reserve bytes: %d\n", class_reserve_bytes(TLRANDOM_QOS_BULK));
+	for (i = 0; i < TLRANDOM_QOS_CLASSES; i++) {
+		seq_printf(m, "%s delivered bytes: %llu\n", qosClassNames[i], qosDelivered[i] + (u64)atomic64_read(&lockFreeDelivered[i]));
+		seq_printf(m, "%s throttled reads: %lu\n", qosClassNames[i], qosThrottled[i]);
+	}
+	if (auditState != NULL) {
+		seq_printf(m, "audit mode: %d\n", auditMode);
+		seq_printf(m, "audit anchors: %lu\n", auditState->anchors);
+		seq_printf(m, "audit bloom hits: %lu\n", auditState->bloomHits);
+		seq_printf(m, "audit duplicates: %lu\n", auditState->duplicates);
+	}
+	return SUCCESS;
+}
+
+static int stats_open(struct inode *inode, struct file *file) {
+	return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations statsFops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * Create the 'stats' debugfs file, removed along with the traffic files
+ *
+ */
+static void init_stats(void) {
+	if (IS_ENABLED(CONFIG_TLRANDOM_STATS) && debugDir != NULL) {
+		debugfs_create_file("stats", 0444, debugDir, NULL, &statsFops);
+	}
+}
 
-		end = get_seconds();
-		secsWaited = end - start;
-		if (transferred > 2) {
-			for (i = 0; i < transferred; i++) {
-				if ( (i % usbData->bulk_in_size) == 0) {
-					i++;
-					continue;
-				} else {
-					buff[cnt++] = usbData->bulk_in_buffer[i];
-					if (cnt >= length) {
-						break;
-					}
-				}
-			}
+/**
+ * Create the debugfs files for recording and replaying the USB traffic:
+ * 'traffic' holds the recording and 'traffic_status' shows the replay results
+ *
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static int init_traffic(void) {
+	if (!IS_ENABLED(CONFIG_TLRANDOM_TRAFFIC) && !IS_ENABLED(CONFIG_TLRANDOM_STATS)) {
+		// Built without any debugfs files
+		return SUCCESS;
+	}
+	if (IS_ENABLED(CONFIG_TLRANDOM_TRAFFIC) && trafficMode == TRAFFIC_RECORD) {
+		// Recording was requested when loading the module
+		if (alloc_traffic_buff() == SUCCESS) {
+			isTrafficStartPending = true;
+		} else {
+			trafficMode = TRAFFIC_OFF;
 		}
-	} while ( cnt < length && secsWaited < opTimeoutSecs);
-
-	if (cnt != length) {
-		#ifdef inDebugMode
-			printk(KERN_INFO "timeout received, cnt %d\n", cnt);
-		#endif
-		return -ETIMEDOUT;
 	}
+	isTrafficRdy = true;
 
+	debugDir = debugfs_create_dir(DEVICE_NAME, NULL);
+	if (IS_ERR_OR_NULL(debugDir)) {
+		// Not fatal, the device works without record and replay
+		printk(KERN_INFO "Could not create the debugfs directory, USB traffic recording is not available\n");
+		debugDir = NULL;
+		return SUCCESS;
+	}
+	if (IS_ENABLED(CONFIG_TLRANDOM_TRAFFIC)) {
+		debugfs_create_file("traffic", 0600, debugDir, NULL, &trafficFops);
+		debugfs_create_file("traffic_status", 0400, debugDir, NULL, &trafficStatusFops);
+	}
 	return SUCCESS;
 }
 
+/**
+ * Remove the debugfs files and free the USB traffic recording
+ *
+ */
+static void uninit_traffic(void) {
+	isTrafficRdy = false;
+	debugfs_remove_recursive(debugDir);
+	debugDir = NULL;
+	if (trafficBuff != NULL) {
+		vfree(trafficBuff);
+		trafficBuff = NULL;
+	}
+}
+
 /**
  * A function to handle the event when caller requests a device write operation
  *
@@ -504,6 +4218,250 @@ static loff_t device_llseek(struct file *filp, loff_t off, int whence)
 	return -EPERM;
 }
 
+/**
+ * Fill an array of user space buffers, the TLRANDOM_IOC_FILL request. A buffer the rate limit of the
+ * class grants only part of is filled on as the tokens come in.
+ *
+ * @param struct reader_ctx *ctx - the reader context of the open file
+ * @param struct tlrandom_fill __user *argp - pointer to the request in the user space
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static long ioctl_fill(struct reader_ctx *ctx, struct tlrandom_fill __user *argp) {
+	struct tlrandom_fill fill;
+	struct tlrandom_iovec iov;
+	struct tlrandom_iovec __user *iovp;
+	ssize_t retval;
+	__u64 done;
+	uint32_t i;
+
+	if (copy_from_user(&fill, argp, sizeof(fill))) {
+		return -EFAULT;
+	}
+	if (fill.iovCnt > TLRANDOM_MAX_IOV || fill.reserved != 0) {
+		return -EINVAL;
+	}
+
+	iovp = u64_to_user_ptr(fill.iov);
+	fill.filled = 0;
+	retval = SUCCESS;
+	for (i = 0; i < fill.iovCnt; i++) {
+		if (copy_from_user(&iov, iovp + i, sizeof(iov))) {
+			retval = -EFAULT;
+			break;
+		}
+		for (done = 0; done < iov.len; done += (__u64)retval) {
+			retval = read_user_bytes(ctx, u64_to_user_ptr(iov.base + done), NULL, iov.len - done, false);
+			if (retval <= 0) {
+				break;
+			}
+			fill.filled += retval;
+			if (signal_pending(current)) {
+				// Return what was filled so far
+				done += (__u64)retval;
+				break;
+			}
+		}
+		if (retval < 0 || done < iov.len) {
+			break;
+		}
+	}
+
+	// Bytes already handed out are reported even when a later buffer failed
+	if (fill.filled > 0 || retval >= 0) {
+		if (put_user(fill.filled, &argp->filled)) {
+			return -EFAULT;
+		}
+		return SUCCESS;
+	}
+	return retval;
+}
+
+/**
+ * Get the output buffer level, the device state and the health test state
+ *
+ * @param struct tlrandom_status *status - filled with the status
+ *
+ */
+static void get_status(struct tlrandom_status *status) {
+	memset(status, 0, sizeof(*status));
+	status->bufferedBytes = reservoir_unread();
+	status->bufferSize = outBufferBytes;
+	status->isDeviceReady = isEntropySrcRdy && !isStartupPending;
+	status->isDeviceGone = isDeviceGone;
+	if (rctData.statusByte != SUCCESS) {
+		status->healthStatus = TLRANDOM_HEALTH_RCT_FAILED;
+	} else if (aptData.statusByte != SUCCESS) {
+		status->healthStatus = TLRANDOM_HEALTH_APT_FAILED;
+	} else {
+		status->healthStatus = TLRANDOM_HEALTH_OK;
+	}
+	status->rctFailures = rctData.failureCount;
+	status->aptFailures = aptData.cycleFailures;
+	status->failThreshold = rctData.failThreshold;
+}
+
+/**
+ * Estimate the entropy of the buffered output from the entropy the conditioning profile declares
+ *
+ * @param struct tlrandom_entropy *entropy - filled with the estimate
+ *
+ */
+static void get_entropy_estimate(struct tlrandom_entropy *entropy) {
+	uint64_t outBits;
+
+	memset(entropy, 0, sizeof(*entropy));
+	entropy->bufferedBytes = reservoir_unread();
+	outBits = entropy->bufferedBytes * 8;
+	entropy->entropyPerMille = cond_entropy_per_mille();
+	entropy->entropyBits = div_u64(outBits * entropy->entropyPerMille, 1000);
+}
+
+/**
+ * Get the transfer and error counters
+ *
+ * @param struct tlrandom_stats *stats - filled with the counters
+ *
+ */
+static void get_stats(struct tlrandom_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	stats->deliveredBytes = delivered_bytes();
+	stats->refills = refillCount;
+	stats->prefetches = prefetchCount;
+	stats->retries = retryCount;
+	stats->haltClears = haltClearCount;
+	stats->resets = resetCount;
+	stats->suspends = suspendCount;
+	stats->wakeUps = wakeCount;
+	stats->wakeUsMax = wakeUsMax;
+	stats->disconnects = disconnectCount;
+	stats->replugWaits = replugWaitCount;
+	stats->lastXferBytes = lastXferBytes;
+	stats->demandRate = min(demandRate, (unsigned long)U32_MAX);
+}
+
+/**
+ * Replace the buffered output with freshly conditioned bytes, the TLRANDOM_IOC_REFILL request. It takes
+ * the output from the readers of every class, so only CAP_SYS_ADMIN may ask for it.
+ *
+ * @return greater than 0 - number of bytes buffered, otherwise the error code (a negative number)
+ *
+ */
+static long ioctl_refill(void) {
+	long retval;
+
+	if (!capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+	if (!enter_op()) {
+		return -ENODATA;
+	}
+	traffic_replay_wait();
+	if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+		leave_op();
+		return -EINTR;
+	}
+	reservoir_close();
+	// The replaced bytes are never handed out, nothing of them is kept
+	memzero_explicit(buffTRndOut + curTrngOutIdx, trngOutLen - curTrngOutIdx);
+	trngOutLen = 0;
+	curTrngOutIdx = 0;
+	readPending = outBufferBytes;
+	retval = rcv_rnd_bytes();
+	if (retval == SUCCESS) {
+		retval = trngOutLen;
+	}
+	reservoir_open();
+	mutex_unlock(&dataOpLock);
+	leave_op();
+	return retval;
+}
+
+/**
+ * Change the service class of an open file, the TLRANDOM_IOC_SET_QOS request
+ *
+ * @param struct reader_ctx *ctx - the reader context of the open file
+ * @param struct tlrandom_qos __user *argp - pointer to the request in the user space
+ * @return 0 - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static long ioctl_set_qos(struct reader_ctx *ctx, struct tlrandom_qos __user *argp) {
+	struct tlrandom_qos qos;
+
+	if (!IS_ENABLED(CONFIG_TLRANDOM_QOS)) {
+		// Built without service classes
+		return -ENOTTY;
+	}
+	if (copy_from_user(&qos, argp, sizeof(qos))) {
+		return -EFAULT;
+	}
+	if (qos.qosClass >= TLRANDOM_QOS_CLASSES || qos.reserved != 0) {
+		return -EINVAL;
+	}
+	if (qos.qosClass == TLRANDOM_QOS_CRITICAL && !capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+	WRITE_ONCE(ctx->qosClass, qos.qosClass);
+	return SUCCESS;
+}
+
+/**
+ * A function to handle the ioctl requests described in tlrandom_ioctl.h
+ *
+ * @param struct file *file - pointer to the file structure of the caller
+ * @param unsigned int cmd - the request
+ * @param unsigned long arg - the request argument
+ * @return 0 or greater - successful operation, otherwise the error code (a negative number)
+ *
+ */
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+	void __user *argp = (void __user *)arg;
+	union {
+		struct tlrandom_status status;
+		struct tlrandom_entropy entropy;
+		struct tlrandom_stats stats;
+		struct tlrandom_qos qos;
+	} u;
+	struct reader_ctx *ctx = file->private_data;
+
+	switch (cmd) {
+	case TLRANDOM_IOC_FILL:
+		return ioctl_fill(ctx, argp);
+	case TLRANDOM_IOC_SET_QOS:
+		return ioctl_set_qos(ctx, argp);
+	case TLRANDOM_IOC_GET_QOS:
+		memset(&u.qos, 0, sizeof(u.qos));
+		u.qos.qosClass = reader_qos_class(ctx);
+		if (copy_to_user(argp, &u.qos, sizeof(u.qos))) {
+			return -EFAULT;
+		}
+		return SUCCESS;
+	case TLRANDOM_IOC_REFILL:
+		return ioctl_refill();
+	case TLRANDOM_IOC_GET_STATUS:
+	case TLRANDOM_IOC_GET_ENTROPY:
+	case TLRANDOM_IOC_GET_STATS:
+		// Taken under the lock, so a refill never shows half way through
+		if(mutex_lock_killable(&dataOpLock) != SUCCESS) {
+			return -EINTR;
+		}
+		if (cmd == TLRANDOM_IOC_GET_STATUS) {
+			get_status(&u.status);
+		} else if (cmd == TLRANDOM_IOC_GET_ENTROPY) {
+			get_entropy_estimate(&u.entropy);
+		} else {
+			get_stats(&u.stats);
+		}
+		mutex_unlock(&dataOpLock);
+		if (copy_to_user(argp, &u, _IOC_SIZE(cmd))) {
+			return -EFAULT;
+		}
+		return SUCCESS;
+	default:
+		return -ENOTTY;
+	}
+}
+
 /*
  * A function for handling module loading event
  * @return greater than 0 - number of bytes actually read, otherwise the error code (a negative number)
@@ -519,22 +4477,36 @@ static int __init init_tlrandom(void)
 	buffTRndOut = NULL;
 
 	mutex_init(&dataOpLock);
+	INIT_WORK(&prefetchWork, prefetch_work);
+	INIT_WORK(&startupWork, startup_work);
 
-	rct_initialize();
-	apt_initialize();
+	tl_rct_initialize(&rctData, TLRANDOM_FAIL_THRESHOLD);
+	tl_apt_initialize(&aptData, TLRANDOM_FAIL_THRESHOLD);
 
-	sha256_initializeSerialNumber(413145);
 	if (sha256_selfTest() != SUCCESS) {
 		printk(KERN_ALERT "Post processing logic failed the self-test\n");
 		return -EPERM;
 	}
 
+	// The nonce gets the device ID at probe time and its boot seed from the first raw block
+	tl_cond_initializeNonce(&shaData, 0, COND_SLICE_MAIN);
+	tl_sha256_initializeSerialNumber(&shaData, 0);
+
+	// The file operations structure is declared in tlrandom.h
+	fops.unlocked_ioctl = device_ioctl;
+	fops.compat_ioctl = compat_ptr_ioctl;
+	fops.read_iter = device_read_iter;
+	fops.poll = device_poll;
+
 	err = init_char_dev();
 	if (err != SUCCESS) {
 		printk(KERN_ALERT "Could not initialize characetr device %s\n", DEVICE_NAME);
 		return err;
 	}
 
+	init_traffic();
+	init_stats();
+
 //	major = register_chrdev(0, DEVICE_NAME, &fops);
 //
 //	if (major < 0) {
@@ -542,31 +4514,45 @@ static int __init init_tlrandom(void)
 //		return major;
 //	}
 
-	// Initialize buffers
-	buffRndIn = kmalloc(RND_IN_BUFFSIZE + 1, GFP_KERNEL);
-	if (buffRndIn == NULL) {
-		printk(KERN_ALERT "Could not allocate %d kernel bytes for the random input buffer\n", RND_IN_BUFFSIZE);
+#ifdef CONFIG_TLRANDOM_OUT_BUFFER_BYTES
+	BUILD_BUG_ON(CONFIG_TLRANDOM_OUT_BUFFER_BYTES < MIN_OUT_BUFFER_BYTES || CONFIG_TLRANDOM_OUT_BUFFER_BYTES > MAX_OUT_BUFFER_BYTES);
+#endif
+	BUILD_BUG_ON(MAX_OUT_BUFFER_BYTES > TL_RESERVOIR_IDX_MASK);
+	BUILD_BUG_ON(4 * OUT_NUM_WORDS > TL_COND_MAX_INPUT_WORDS);
+	// Initialize buffers, the raw input is conditioned straight from the bulk-in transfer buffers
+	if (resize_out_buffer(outBufferBytes, producer_node()) != SUCCESS || alloc_express_pools() != SUCCESS
+			|| apply_audit_mode(auditMode) != SUCCESS) {
 		//unregister_chrdev(major, DEVICE_NAME);
+		uninit_traffic();
 		uninit_char_dev();
+		kvfree_sensitive(buffTRndOut, outBufferBytes);
+		free_express_pools();
 		return -ENOMEM;
 	}
+	isOutBufferRdy = true;
 
-	buffTRndOut = kmalloc(TRND_OUT_BUFFSIZE, GFP_KERNEL);
-	if (buffTRndOut == NULL) {
-		printk(KERN_ALERT "Could not allocate %d kernel bytes for the random output buffer\n", TRND_OUT_BUFFSIZE);
-		//unregister_chrdev(major, DEVICE_NAME);
-		uninit_char_dev();
-		kfree(buffRndIn);
-		return -ENOMEM;
-	}
+	// Runtime power management, the driver structure is declared in tlrandom.h
+	usb_driver.supports_autosuspend = 1;
+	usb_driver.suspend = usb_suspend;
+	usb_driver.resume = usb_resume;
+	usb_driver.reset_resume = usb_resume;
+	// Without these the USB core would rebind the driver on a reset and deadlock on the lock held by the refill
+	usb_driver.pre_reset = usb_pre_reset;
+	usb_driver.post_reset = usb_post_reset;
+	// The device information in sysfs, created and removed with the binding of the interface
+	usb_driver.dev_groups = tlDevGroups;
 
 	usb_result = usb_register(&usb_driver);
 	if (usb_result < 0) {
 		printk(KERN_ALERT "Could not register usb driver, error number %d\n", usb_result);
 		//unregister_chrdev(major, DEVICE_NAME);
+		uninit_traffic();
 		uninit_char_dev();
-		kfree(buffRndIn);
-		kfree(buffTRndOut);
+		kvfree_sensitive(buffTRndOut, outBufferBytes);
+		free_express_pools();
+		static_branch_disable(&auditEnabled);
+		kvfree(auditState);
+		auditState = NULL;
 		return usb_result;
 	}
 
@@ -676,278 +4662,36 @@ static void __exit exit_tlrandom(void)
 {
 	isEntropySrcRdy = false;
 	isShutDown = true;
-	msleep(2000);
-	wait_for_pending_ops();
+	wake_up_all(&deviceWait);
+	wake_up_interruptible_poll(&readWait, EPOLLHUP);
 	usb_deregister(&usb_driver);
+	wait_for_pending_ops();
+	cancel_work_sync(&startupWork);
+	cancel_work_sync(&prefetchWork);
+	uninit_traffic();
 	//unregister_chrdev(major, DEVICE_NAME);
 	uninit_char_dev();
-	kfree(buffRndIn);
-	kfree(buffTRndOut);
+	mutex_lock(&dataOpLock);
+	isOutBufferRdy = false;
+	kvfree_sensitive(buffTRndOut, outBufferBytes);
+	buffTRndOut = NULL;
+	free_express_pools();
+	static_branch_disable(&auditEnabled);
+	kvfree(auditState);
+	auditState = NULL;
+	mutex_unlock(&dataOpLock);
 	mutex_destroy(&dataOpLock);
 	printk(KERN_INFO "Char device %s unregistered successfully\n", DEVICE_NAME);
 }
 
 /**
- * A function to wait a little for any pending operations used when unloading the module
+ * A function to wait until the last reader and background refill have left, used when unloading the module
  *
  */
 static void wait_for_pending_ops(void) {
-	int cnt;
-	for(cnt = 0; cnt < 100 && (isDeviceOpPending == true || isUsbOpPending == true); cnt++) {
-		msleep(100);
-	}
-}
-
-/**
- * Initialize the SHA256 data
- *
- */
-static void sha256_initialize(void) {
-	// Initialize H0, H1, H2, H3, H4, H5, H6 and H7
-	sd.h0 = 0x6a09e667;
-	sd.h1 = 0xbb67ae85;
-	sd.h2 = 0x3c6ef372;
-	sd.h3 = 0xa54ff53a;
-	sd.h4 = 0x510e527f;
-	sd.h5 = 0x9b05688c;
-	sd.h6 = 0x1f83d9ab;
-	sd.h7 = 0x5be0cd19;
-}
-
-/**
- * Stamp a new serial number for the input data block into the last word
- *
- * @param void* inputBlock pointer to the input hashing block
- *
- */
-static void sha256_stampSerialNumber(void *inputBlock)
-{
-	uint32_t *inw = (uint32_t*)inputBlock;
-	inw[MIN_INPUT_NUM_WORDS] = sd.blockSerialNumber++;
-}
-
-/**
- * Initialize the serial number for hashing
- *
- * @param uint32_t initValue - a startup random number for generating serial number for hashing
- *
- */
-static void sha256_initializeSerialNumber(uint32_t initValue) {
-	sd.blockSerialNumber = initValue;
-}
-
-/**
- * Generate SHA256 value.
- *
- * @param uint32_t* src - pointer to an array of 32 bit words used as hash input
- * @param uint32_t dst - pointer to an array of 8 X 32 bit words used as hash output
- * @param int16_t len - number of 32 bit words available in array pointed by 'src'
- *
- * @return int 0 for successful operation, -1 for invalid parameters
- *
- */
-static int sha256_generateHash(uint32_t *src, int16_t len, uint32_t *dst) {
-
-	uint16_t blockNum;
-	uint8_t ui8;
-	int32_t initialMessageSize;
-	uint16_t numCompleteDataBlocks;
-	uint16_t reminder;
-	uint16_t srcOffset;
-	uint8_t needAdditionalBlock;
-	uint8_t needToAddOneMarker;
-
-	if (len <= 0) {
-		return -1;
-	}
-
-	sha256_initialize();
-
-	initialMessageSize = len * 8 * 4;
-	numCompleteDataBlocks = len / maxDataBlockSizeWords;
-	reminder = len % maxDataBlockSizeWords;
-
-	// Process complete blocks
-	for (blockNum = 0; blockNum < numCompleteDataBlocks; blockNum++) {
-		srcOffset = blockNum * maxDataBlockSizeWords;
-		for (ui8 = 0; ui8 < maxDataBlockSizeWords; ui8++) {
-			sd.w[ui8] = src[ui8 + srcOffset];
-		}
-		// Hash the current block
-		sha256_hashCurrentBlock();
-	}
-
-	srcOffset = numCompleteDataBlocks * maxDataBlockSizeWords;
-	needAdditionalBlock = 1;
-	needToAddOneMarker = 1;
-	if (reminder > 0) {
-		// Process the last data block if any
-		ui8 = 0;
-		for (; ui8 < reminder; ui8++) {
-			sd.w[ui8] = src[ui8 + srcOffset];
-		}
-		// Append '1' to the message
-		sd.w[ui8++] = 0x80000000;
-		needToAddOneMarker = 0;
-		if (ui8 < maxDataBlockSizeWords - 1) {
-			for (; ui8 <  maxDataBlockSizeWords - 2; ui8++) {
-				// Fill with zeros
-				sd.w[ui8] = 0x0;
-			}
-			// add the message size to the current block
-			sd.w[ui8++] = 0x0;
-			sd.w[ui8] = initialMessageSize;
-			sha256_hashCurrentBlock();
-			needAdditionalBlock = 0;
-		} else {
-			// Fill the rest with '0'
-			// Will need to create another block
-			sd.w[ui8] = 0x0;
-			sha256_hashCurrentBlock();
-		}
-	}
-
-	if (needAdditionalBlock) {
-		ui8 = 0;
-		if (needToAddOneMarker) {
-			sd.w[ui8++] = 0x80000000;
-		}
-		for (; ui8 <  maxDataBlockSizeWords - 2; ui8++) {
-			sd.w[ui8] = 0x0;
-		}
-		sd.w[ui8++] = 0x0;
-		sd.w[ui8] = initialMessageSize;
-		sha256_hashCurrentBlock();
-	}
-
-	// Save the results
-	dst[0] = sd.h0;
-	dst[1] = sd.h1;
-	dst[2] = sd.h2;
-	dst[3] = sd.h3;
-	dst[4] = sd.h4;
-	dst[5] = sd.h5;
-	dst[6] = sd.h6;
-	dst[7] = sd.h7;
-
-	return 0;
-}
-
-/**
- * Hash current block
- *
- */
-static void sha256_hashCurrentBlock(void) {
-	uint8_t t;
-
-	// Process elements 16...63
-	for (t = 16; t <= 63; t++) {
-		sd.w[t] = sha256_sigma1(&sd.w[t-2]) + sd.w[t-7] + sha256_sigma0(&sd.w[t-15]) + sd.w[t-16];
-	}
-
-	// Initialize variables
-	sd.a = sd.h0;
-	sd.b = sd.h1;
-	sd.c = sd.h2;
-	sd.d = sd.h3;
-	sd.e = sd.h4;
-	sd.f = sd.h5;
-	sd.g = sd.h6;
-	sd.h = sd.h7;
-
-	// Process elements 0...63
-	for (t = 0; t <= 63; t++) {
-		sd.tmp1 = sd.h + sha256_sum1(&sd.e) + sha256_ch(&sd.e, &sd.f, &sd.g) + k[t] + sd.w[t];
-		sd.tmp2 = sha256_sum0(&sd.a) + sha256_maj(&sd.a, &sd.b, &sd.c);
-		sd.h = sd.g;
-		sd.g = sd.f;
-		sd.f = sd.e;
-		sd.e = sd.d + sd.tmp1;
-		sd.d = sd.c;
-		sd.c = sd.b;
-		sd.b = sd.a;
-		sd.a = sd.tmp1 + sd.tmp2;
-	}
-
-	// Calculate the final hash for the block
-	sd.h0 += sd.a;
-	sd.h1 += sd.b;
-	sd.h2 += sd.c;
-	sd.h3 += sd.d;
-	sd.h4 += sd.e;
-	sd.h5 += sd.f;
-	sd.h6 += sd.g;
-	sd.h7 += sd.h;
-}
-
-/**
- * FIPS PUB 180-4 section 4.1.2 formula (4.2)
- *
- * @param uint32_t* x pointer to variable x
- * @param uint32_t* y pointer to variable y
- * @param uint32_t* z pointer to variable z
- * $return uint32_t Ch value
- *
- */
-static uint32_t sha256_ch(uint32_t *x, uint32_t *y, uint32_t *z) {
-	return  ((*x) & (*y)) ^ (~(*x) & (*z));
-}
-
-/**
- * FIPS PUB 180-4 section 4.1.2 formula (4.3)
- *
- * @param uint32_t* x pointer to variable x
- * @param uint32_t* y pointer to variable y
- * @param uint32_t* z pointer to variable z
- * $return uint32_t Maj value
- *
- */
-static uint32_t sha256_maj(uint32_t *x, uint32_t *y, uint32_t *z) {
-	return ((*x) & (*y)) ^ ((*x) & (*z)) ^ ((*y) & (*z));
-}
-
-/**
- * FIPS PUB 180-4 section 4.1.2 formula (4.4)
- *
- * @param uint32_t* x pointer to variable x
- * $return uint32_t Sum0 value
- *
- */
-static uint32_t sha256_sum0(uint32_t *x) {
-	return ROTR(2, *x) ^ ROTR(13, *x) ^ ROTR(22, *x);
-}
-
-/**
- * FIPS PUB 180-4 section 4.1.2 formula (4.5)
- *
- * @param uint32_t* x pointer to variable x
- * $return uint32_t Sum1 value
- *
- */
-static uint32_t sha256_sum1(uint32_t *x) {
-	return ROTR(6, *x) ^ ROTR(11, *x) ^ ROTR(25, *x);
-}
-
-/**
- * FIPS PUB 180-4 section 4.1.2 formula (4.6)
- *
- * @param uint32_t* x pointer to variable x
- * $return uint32_t sigma0 value
- *
- */
-static uint32_t sha256_sigma0(uint32_t *x) {
-	return ROTR(7, *x) ^ ROTR(18, *x) ^ ((*x) >> 3);
-}
-
-/**
- * FIPS PUB 180-4 section 4.1.2 formula (4.7)
- *
- * @param uint32_t* x pointer to variable x
- * $return uint32_t sigma1 value
- *
- */
-static uint32_t sha256_sigma1(uint32_t *x) {
-	return ROTR(17, *x) ^ ROTR(19, *x) ^ ((*x) >> 10);
+	// Drop the bias, new operations are refused from now on
+	leave_op();
+	wait_for_completion(&pendingOpsDone);
 }
 
 /**
@@ -960,95 +4704,21 @@ static int sha256_selfTest(void) {
 	uint32_t results[8];
 	int retVal;
 
-	retVal = sha256_generateHash((uint32_t*)testSeq1, (uint16_t)11, (uint32_t*)results);
+	retVal = tl_sha256_generateHash(&shaData, (uint32_t*)testSeq1, (uint16_t)11, (uint32_t*)results);
 	if (retVal == 0) {
 		// Compare the expected with actual results
 		retVal = memcmp(results, exptHashSeq1, 8);
 	}
-	return retVal;
-}
-
-static void rct_initialize(void) {
-	memset(&rct, 0x00, sizeof (rct));
-	rct.statusByte = 0;
-	rct.signature = 1;
-	rct.maxRepetitions = 5;
-	rct_restart();
-}
-
-static void rct_restart(void) {
-	rct.isInitialized = false;
-	rct.curRepetitions = 1;
-	rct.failureWindow = 0;
-	rct.failureCount = 0;
-}
-
-static void rct_sample(uint8_t value) {
-	if (!rct.isInitialized) {
-		rct.isInitialized = true;
-		rct.lastSample = value;
-	} else {
-		if (rct.lastSample == value) {
-			rct.curRepetitions++;
-			if (rct.curRepetitions >= rct.maxRepetitions) {
-				rct.curRepetitions = 1;
-				if (++rct.failureCount >= numConsecFailThreshold) {
-					if (rct.statusByte == 0) {
-						rct.statusByte = rct.signature;
-					}
-				}
-			}
-
-		} else {
-			rct.lastSample = value;
-			rct.curRepetitions = 1;
-		}
+	if (retVal == 0) {
+		// FIPS 180 test vectors
+		retVal = tl_sha256_knownAnswerTest(&shaData);
 	}
-
-}
-
-
-static void apt_initialize(void) {
-	memset(&apt, 0x00, sizeof (apt));
-	apt.statusByte = 0;
-	apt.signature = 2;
-	apt.windowSize = 64;
-	apt.cutoffValue = 5;
-	apt_restart();
-}
-
-static void apt_restart(void) {
-	apt.isInitialized = false;
-	apt_restart_cycle();
-}
-
-static void apt_restart_cycle(void) {
-	apt.cycleFailures = 0;
-}
-
-static void apt_sample(uint8_t value) {
-	if (!apt.isInitialized) {
-		apt.isInitialized = true;
-		apt.firstSample = value;
-		apt.curRepetitions = 0;
-		apt.curSamples = 0;
-	} else {
-		if (++apt.curSamples >= apt.windowSize) {
-			apt.isInitialized = false;
-		}
-		if (apt.firstSample == value) {
-			if (++apt.curRepetitions > apt.cutoffValue) {
-				// Check to see if we have reached the failure threshold
-				if (++apt.cycleFailures >= numConsecFailThreshold) {
-					if (apt.statusByte == 0) {
-						apt.statusByte = apt.signature;
-					}
-				}
-			} else {
-				apt_restart_cycle();
-			}
-		}
+	if (retVal == 0 && IS_ENABLED(CONFIG_TLRANDOM_COND_HMAC)) {
+		// RFC 4231 test vector, then the key used by the HMAC conditioning profile
+		retVal = tl_hmac_sha256_knownAnswerTest(&shaData, &hmacData);
+		tl_hmac_sha256_initialize(&shaData, &hmacData, tl_cond_hmacKey, ARRAY_SIZE(tl_cond_hmacKey));
 	}
+	return retVal;
 }
 
 module_init( init_tlrandom);